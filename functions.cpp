@@ -2,19 +2,222 @@
 #include <fstream>
 #include <vector>
 #include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <queue>
+#include <cstdio>
+#include <cstring>
+#include <cfloat>
+#include <climits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/features2d/features2d.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
 #include "structs.h"
+#include "jpeg.hpp"
 
 using namespace std;
 using namespace cv;
 using boost::property_tree::ptree;
 
+//number of worker threads for the analyses, 0 means one per CPU core
+static int num_threads = 0;
+
+//threads doing analysis work, the main thread included. Threads join the pool
+//with acquire_worker, and parallel_chunks only adds helpers while it is not full
+static mutex pool_lock;
+static condition_variable pool_released;
+static int busy_threads = 1;
+
+int get_num_threads() {
+	if(num_threads > 0) {
+		return num_threads;
+	}
+
+	int cores = thread::hardware_concurrency();
+	return cores > 0 ? cores : 1;
+}
+
+void set_num_threads(int threads) {
+	num_threads = threads;
+	//also limit the OpenCV functions we call
+	setNumThreads(get_num_threads());
+}
+
+void acquire_worker() {
+	unique_lock<mutex> lock(pool_lock);
+	while(busy_threads >= get_num_threads()) {
+		pool_released.wait(lock);
+	}
+	busy_threads++;
+}
+
+void release_worker() {
+	lock_guard<mutex> lock(pool_lock);
+	busy_threads--;
+	pool_released.notify_one();
+}
+
+int available_threads() {
+	lock_guard<mutex> lock(pool_lock);
+	return 1 + max(get_num_threads() - busy_threads, 0);
+}
+
+//up to wanted more threads for the pool, without waiting for them
+static int try_acquire_workers(int wanted) {
+	lock_guard<mutex> lock(pool_lock);
+	int granted = max(min(wanted, get_num_threads() - busy_threads), 0);
+	busy_threads += granted;
+	return granted;
+}
+
+/*
+	Split [begin, end) into at most get_num_threads() contiguous chunks and run
+	body(chunk_begin, chunk_end, chunk_index) for each of them. The calling
+	thread and as many helpers as the thread pool has free take the chunks in
+	order, so analyses running side by side share the threads and the ones
+	still running get the threads freed by the others on their next call. The
+	split only depends on the range and the thread count, so two calls with the
+	same range hand every chunk index the same chunk
+*/
+void parallel_chunks(int begin, int end, const function<void(int, int, int)> &body) {
+	int length = end - begin;
+	int chunks = min(get_num_threads(), length);
+	if(chunks <= 1) {
+		if(length > 0) body(begin, end, 0);
+		return;
+	}
+
+	atomic<int> next_chunk(0);
+	auto run = [&]() {
+		int t;
+		while((t = next_chunk++) < chunks) {
+			int chunk_begin = begin + (int)((long long)length * t / chunks);
+			int chunk_end = begin + (int)((long long)length * (t+1) / chunks);
+			body(chunk_begin, chunk_end, t);
+		}
+	};
+
+	int helpers = try_acquire_workers(chunks - 1);
+	vector<thread> workers;
+	for(int h=0; h<helpers; h++) {
+		workers.push_back(thread([&]() {
+			run();
+			release_worker();
+		}));
+	}
+	run();
+	for(int h=0; h<helpers; h++) {
+		workers[h].join();
+	}
+}
+
+const Mat &image_cache::grayscale() {
+	call_once(gray_once, [this]() { cvtColor(src, gray, CV_BGR2GRAY); });
+	return gray;
+}
+
+void radix_sort_keys(const uchar *keys, int length, vector<int> &index);
+
+/*
+	Unique colors of an 8-bit BGR image and the number of pixels of each. Pixels
+	are radix sorted by their color bytes (in parallel, see radix_sort_keys) and
+	equal colors then form runs, or on large images counted in a table with a
+	count per possible color, split by color range over the threads. Photos have far fewer colors than pixels, so
+	anything per color (conversions, binning) is much cheaper than per pixel.
+	Colors come out in ascending order of their B, G, R bytes either way
+*/
+void unique_colors(const Mat &src, color_table &table) {
+	size_t total = src.total();
+
+	//the index and radix buffer of the sort take 8 bytes per pixel, from 2^23
+	//pixels on a count per possible color (2^24 ints) is smaller
+	if(total >= (1u << 23)) {
+		//every thread counts the colors of its own range of the table over all
+		//the pixels, so no two threads write the same count
+		vector<int> tally(1 << 24, 0);
+		int shards = available_threads();
+		parallel_chunks(0, shards, [&](int begin, int end, int t) {
+			unsigned first = (unsigned)(((long long)begin << 24) / shards);
+			unsigned range = (unsigned)(((long long)end << 24) / shards) - first;
+			for(int i=0; i<src.rows; i++) {
+				const uchar *pixel = src.ptr<uchar>(i);
+				for(int j=0; j<src.cols; j++, pixel+=3) {
+					unsigned key = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+					if(key - first < range) {
+						tally[key]++;
+					}
+				}
+			}
+		});
+
+		//colors of every chunk of the table, then each chunk fills its part
+		int length = (int)tally.size();
+		vector<int> offsets(get_num_threads() + 1, 0);
+		parallel_chunks(0, length, [&](int begin, int end, int t) {
+			offsets[t+1] = (int)(end - begin - count(tally.begin() + begin, tally.begin() + end, 0));
+		});
+		for(int t=0; t<get_num_threads(); t++) {
+			offsets[t+1] += offsets[t];
+		}
+
+		int unique = offsets.back();
+		table.colors.create(unique, 1, CV_8UC3);
+		table.counts.resize(unique);
+		parallel_chunks(0, length, [&](int begin, int end, int t) {
+			int n = offsets[t];
+			for(int key=begin; key<end; key++) {
+				if(tally[key] > 0) {
+					table.colors.at<Vec3b>(n) = Vec3b(key >> 16, (key >> 8) & 0xFF, key & 0xFF);
+					table.counts[n++] = tally[key];
+				}
+			}
+		});
+		return;
+	}
+
+	//sort the pixels by their 3 color bytes, equal colors then form runs
+	Mat pixels = src.isContinuous() ? src : src.clone();
+	const uchar *keys = pixels.data;
+	vector<int> index(total);
+	for(size_t i=0; i<total; i++) {
+		index[i] = (int)i;
+	}
+	radix_sort_keys(keys, 3, index);
+
+	int unique = 0;
+	for(size_t i=0; i<total; i++) {
+		if(i == 0 || memcmp(keys + 3*(size_t)index[i], keys + 3*(size_t)index[i-1], 3) != 0) unique++;
+	}
+	table.colors.create(unique, 1, CV_8UC3);
+	table.counts.assign(unique, 0);
+	int n = -1;
+	for(size_t i=0; i<total; i++) {
+		const uchar *key = keys + 3*(size_t)index[i];
+		if(i == 0 || memcmp(key, keys + 3*(size_t)index[i-1], 3) != 0) {
+			n++;
+			table.colors.at<Vec3b>(n) = Vec3b(key[0], key[1], key[2]);
+		}
+		table.counts[n]++;
+	}
+}
+
+const color_table &image_cache::colors() {
+	call_once(table_once, [this]() { unique_colors(src, table); });
+	return table;
+}
+
 /*
 	HSV Histogram Stretch (Auto-Levels)
 	converts the image to HSV colorspace and then applies histogram equalization
@@ -43,191 +246,708 @@ void hsv_histogram_stretch(Mat &src, Mat &dst) {
 }
 
 /*
-	HSV Histogram Analysis
-	convert image to float and change colorspace to HSV. Count all H,S pairs and
-	compute frequency + the total value for V for each pair. Divide the total value
-	by the frequency and create the histogram image
+	Per bin average of a value over the unique colors of an image, weighted by
+	their pixel counts. bin_of(i, bin, value) gives the flat bin index and the
+	value of color i, it is a template parameter so the call is inlined into the
+	binning loop. Counts are exact integers and sums are doubles.
+
+	The colors are binned in parallel first. Then every thread owns a range of
+	the bins and sums the colors falling in it, in color order, so no tables are
+	merged and the result does not depend on the thread count. dst is
+	rows x cols CV_32F, 0 in empty bins
+*/
+template<typename binner>
+void average_by_bin(const color_table &table, int rows, int cols, const binner &bin_of, Mat &dst) {
+	int n = table.counts.size(), bins = rows * cols;
+
+	vector<int> color_bins(n);
+	vector<float> values(n);
+	parallel_chunks(0, n, [&](int begin, int end, int t) {
+		for(int i=begin; i<end; i++) {
+			bin_of(i, color_bins[i], values[i]);
+		}
+	});
+
+	//one bin range per thread that can run now, each range is a pass over the colors
+	int shards = max(1, min(available_threads(), bins));
+	dst.create(rows, cols, CV_32F);
+	float *average = dst.ptr<float>();
+	parallel_chunks(0, shards, [&](int begin, int end, int t) {
+		int first = (int)((long long)bins * begin / shards), last = (int)((long long)bins * end / shards);
+		unsigned range = last - first;
+		vector<long long> counts(range, 0);
+		vector<double> sums(range, 0);
+		for(int i=0; i<n; i++) {
+			unsigned b = (unsigned)(color_bins[i] - first);
+			if(b < range) {
+				counts[b] += table.counts[i];
+				sums[b] += (double)values[i] * table.counts[i];
+			}
+		}
+		for(unsigned b=0; b<range; b++) {
+			average[first + b] = counts[b] > 0 ? (float)(sums[b] / counts[b]) : 0;
+		}
+	});
+}
 
-	implementation adapted from Samuel Albrecht's GIMP plugin
-	https://sites.google.com/site/elsamuko/forensics/hsv-analysis
+/*
+	Colorspaces of the histogram engine. Each one has the bin dimensions as
+	compile time constants and
+	convert: the unique 8-bit BGR colors to a float Nx1 3 channel Mat
+	bin: a converted color to its flat bin index and the value averaged there
+	paint: the color of a non empty bin (row, col) with the average value avg
+	background: the color of empty bins
+	back: the conversion from paint colors to float BGR in [0,1]
+	transposed: bin (row, col) is drawn at (col, row)
 */
-void hsv_histogram(Mat &src, Mat &dst, bool whitebg = false) {
-	Vec3f bgcolor = Vec3f(0,0,0);
-	if(whitebg) {
-		bgcolor = Vec3f(0,0,1);
+
+//H: (0, 360) S: (0, 1) V: (0, 1), bins are S rows x H cols, average V
+struct hsv_space {
+	static constexpr int rows = 256, cols = 360;
+	static constexpr int back = CV_HSV2BGR;
+	static constexpr bool transposed = false;
+
+	static void convert(const Mat &colors, Mat &dst) {
+		colors.convertTo(dst, CV_32F, 1.0/255.0);
+		cvtColor(dst, dst, CV_BGR2HSV);
+	}
+	static inline void bin(const Vec3f &pixel, int &bin, float &value) {
+		int H = (int)round(pixel[0]) % cols, S = round(pixel[1]*255); //hue 359.5 and up wraps to 0
+		bin = S * cols + H;
+		value = pixel[2];
+	}
+	static inline Vec3f paint(int s, int h, float avg) {
+		return Vec3f(h, s/255.0, avg);
 	}
-	Mat hsv;
-	src.convertTo(hsv, CV_32F, 1.0/255.0);
-	cvtColor(hsv, hsv, CV_BGR2HSV);
-	//H: (0, 360) S: (0, 1) V: (0, 1)
+	static Vec3f background(bool whitebg) {
+		return whitebg ? Vec3f(0,0,1) : Vec3f(0,0,0);
+	}
+};
 
-	//count and calculate average V for each (H,S)
-	int hbins = 360, sbins = 256;
-	Mat hist = Mat::zeros(sbins, hbins, CV_32F);
-	Mat sums = Mat::zeros(sbins, hbins, CV_32F);
-	for(int i=0; i<src.rows; i++) {
-		for(int j=0; j<src.cols; j++) {
-			Vec3f pixel = hsv.at<Vec3f>(i,j);
-			int H = round(pixel[0]), S = round(pixel[1]*255);
-			hist.at<float>(S, H)++;
-			sums.at<float>(S, H) += pixel[2];
-		}
+//H: (0, 360) L: (0, 1) S: (0, 1), bins are S rows x H cols, average L
+struct hls_space {
+	static constexpr int rows = 256, cols = 360;
+	static constexpr int back = CV_HLS2BGR;
+	static constexpr bool transposed = false;
+
+	static void convert(const Mat &colors, Mat &dst) {
+		colors.convertTo(dst, CV_32F, 1.0/255.0);
+		cvtColor(dst, dst, CV_BGR2HLS);
+	}
+	static inline void bin(const Vec3f &pixel, int &bin, float &value) {
+		int H = (int)round(pixel[0]) % cols, S = round(pixel[2]*255);
+		bin = S * cols + H;
+		value = pixel[1];
+	}
+	static inline Vec3f paint(int s, int h, float avg) {
+		return Vec3f(h, avg, s/255.0);
+	}
+	static Vec3f background(bool whitebg) {
+		return whitebg ? Vec3f(0,1,0) : Vec3f(0,0,0);
+	}
+};
+
+//L: (0, 100) a: (-127, 127) b: (-127, 127), bins are a x b at 1/scale steps, average L
+template<int scale>
+struct lab_space {
+	static constexpr int rows = 256 * scale, cols = 256 * scale;
+	static constexpr int back = CV_Lab2BGR;
+	static constexpr bool transposed = true;
+
+	static inline void bin(const Vec3f &pixel, int &bin, float &value) {
+		int A = round(scale*(pixel[1]+128)), B = round(scale*(pixel[2]+128));
+		bin = A * cols + B;
+		value = pixel[0];
+	}
+	static inline Vec3f paint(int a, int b, float avg) {
+		return Vec3f(avg, a - rows/2, b - cols/2);
+	}
+	static Vec3f background(bool whitebg) {
+		return whitebg ? Vec3f(100,0,0) : Vec3f(0,0,0);
+	}
+};
+
+//Lab from float colors
+struct lab_float_space : lab_space<4> {
+	static void convert(const Mat &colors, Mat &dst) {
+		colors.convertTo(dst, CV_32F, 1.0/255.0);
+		cvtColor(dst, dst, CV_BGR2Lab);
+	}
+};
+
+//Lab from 8-bit colors, cheaper but less accurate
+struct lab_8u_space : lab_space<1> {
+	static void convert(const Mat &colors, Mat &dst) {
+		cvtColor(colors, dst, CV_BGR2Lab);
+		dst.convertTo(dst, CV_32F);
+		vector<Mat> chn;
+		split(dst, chn);
+		chn[0] = (chn[0] / 255.0) * 100.0;
+		chn[1] = chn[1] - 128;
+		chn[2] = chn[2] - 128;
+		merge(chn, dst);
+	}
+};
+
+/*
+	Y: (0, 1) Cr: (0, 255) Cb: (0, 255), bins are Cb rows x Cr cols, average Y.
+	The 8-bit conversion is the JFIF one, so the bins are the chroma values a
+	JPEG encoder stores
+*/
+struct ycbcr_space {
+	static constexpr int rows = 256, cols = 256;
+	static constexpr int back = CV_YCrCb2BGR;
+	static constexpr bool transposed = true;
+
+	static void convert(const Mat &colors, Mat &dst) {
+		cvtColor(colors, dst, CV_BGR2YCrCb);
+		dst.convertTo(dst, CV_32F);
+		vector<Mat> chn;
+		split(dst, chn);
+		chn[0] = chn[0] / 255.0;
+		merge(chn, dst);
+	}
+	static inline void bin(const Vec3f &pixel, int &bin, float &value) {
+		bin = (int)pixel[2] * cols + (int)pixel[1];
+		value = pixel[0];
+	}
+	static inline Vec3f paint(int cb, int cr, float avg) {
+		return Vec3f(avg, cr/255.0, cb/255.0);
 	}
+	static Vec3f background(bool whitebg) {
+		return whitebg ? Vec3f(1,0.5,0.5) : Vec3f(0,0.5,0.5);
+	}
+};
 
-	divide(sums, hist, hist);
+/*
+	Colorspace Histogram Analysis
+	tally the unique colors of the image, convert only those to the colorspace.
+	Count all pairs of the two binned channels and compute the frequency + the
+	total of the third channel for each pair. Divide the total by the frequency
+	and create the histogram image
+
+	implementation adapted from Samuel Albrecht's GIMP plugins
+	https://sites.google.com/site/elsamuko/forensics/hsv-analysis
+	https://sites.google.com/site/elsamuko/forensics/lab-analysis
+*/
+template<typename space>
+void colorspace_histogram(image_cache &cache, Mat &dst, bool whitebg) {
+	const color_table &table = cache.colors();
+	Mat converted;
+	space::convert(table.colors, converted);
+	const Vec3f *pixels = converted.ptr<Vec3f>();
+
+	//count and calculate the average value for each bin
+	Mat hist;
+	average_by_bin(table, space::rows, space::cols, [pixels](int i, int &bin, float &value) {
+		space::bin(pixels[i], bin, value);
+	}, hist);
 
 	//draw histogram
-	Mat hsv_histogram = Mat::zeros(sbins, hbins, CV_32FC3);
-	for(int s=0; s<sbins; s++) {
-		for(int h=0; h<hbins; h++) {
-			float avg = hist.at<float>(s,h);
-			if(avg > 0) {
-				hsv_histogram.at<Vec3f>(s, h) = Vec3f(h, s/255.0, avg);
-			} else {
-				hsv_histogram.at<Vec3f>(s, h) = bgcolor;
+	Vec3f bgcolor = space::background(whitebg);
+	Mat histogram = space::transposed ? Mat(space::cols, space::rows, CV_32FC3) : Mat(space::rows, space::cols, CV_32FC3);
+	parallel_chunks(0, space::rows, [&](int begin, int end, int t) {
+		for(int r=begin; r<end; r++) {
+			const float *avg = hist.ptr<float>(r);
+			for(int c=0; c<space::cols; c++) {
+				Vec3f color = avg[c] > 0 ? space::paint(r, c, avg[c]) : bgcolor;
+				if(space::transposed) {
+					histogram.at<Vec3f>(c, r) = color;
+				} else {
+					histogram.at<Vec3f>(r, c) = color;
+				}
 			}
 		}
-	}
+	});
 
 	//back to 8-bit rgb
-	cvtColor(hsv_histogram, hsv_histogram, CV_HSV2BGR);
-	hsv_histogram.convertTo(dst, CV_8U, 255);
+	cvtColor(histogram, histogram, space::back);
+	histogram.convertTo(dst, CV_8U, 255);
 }
 
 /*
-	Lab Histogram Analysis
-	convert image to float and change colorspace to Lab. Count all a,b pairs and
-	compute the frequency + total value for L for each pair. Divide & display the
-	resulting histogram image
+	HSV Histogram Analysis
+	average V for each (H,S)
+*/
+void hsv_histogram(image_cache &cache, Mat &dst, bool whitebg = false) {
+	colorspace_histogram<hsv_space>(cache, dst, whitebg);
+}
 
-	implementation adapted from Samuel Albrecht's GIMP plugin
-	https://sites.google.com/site/elsamuko/forensics/lab-analysis
+void hsv_histogram(Mat &src, Mat &dst, bool whitebg = false) {
+	image_cache cache(src);
+	hsv_histogram(cache, dst, whitebg);
+}
+
+/*
+	HLS Histogram Analysis
+	average L for each (H,S)
 */
+void hls_histogram(image_cache &cache, Mat &dst, bool whitebg = false) {
+	colorspace_histogram<hls_space>(cache, dst, whitebg);
+}
+
+void hls_histogram(Mat &src, Mat &dst, bool whitebg = false) {
+	image_cache cache(src);
+	hls_histogram(cache, dst, whitebg);
+}
+
+/*
+	Lab Histogram Analysis
+	average L for each (a,b), a and b in 1/4 steps
+*/
+void lab_histogram(image_cache &cache, Mat &dst, bool whitebg = false) {
+	colorspace_histogram<lab_float_space>(cache, dst, whitebg);
+}
+
 void lab_histogram(Mat &src, Mat &dst, bool whitebg = false) {
-	Vec3f bgcolor = Vec3f(0,0,0);
-	if(whitebg) {
-		bgcolor = Vec3f(100,0,0);
+	image_cache cache(src);
+	lab_histogram(cache, dst, whitebg);
+}
+
+/*
+	Fast version of Lab Histogram, converting to Lab from CV_8U rather than
+	CV_32F saves a ton of time, but its less accurate.
+*/
+void lab_histogram_fast(image_cache &cache, Mat &dst, bool whitebg = false) {
+	colorspace_histogram<lab_8u_space>(cache, dst, whitebg);
+}
+
+void lab_histogram_fast(Mat &src, Mat &dst, bool whitebg = false) {
+	image_cache cache(src);
+	lab_histogram_fast(cache, dst, whitebg);
+}
+
+/*
+	YCbCr Histogram Analysis
+	average Y for each (Cb,Cr), in the JPEG color domain
+*/
+void ycbcr_histogram(image_cache &cache, Mat &dst, bool whitebg = false) {
+	colorspace_histogram<ycbcr_space>(cache, dst, whitebg);
+}
+
+void ycbcr_histogram(Mat &src, Mat &dst, bool whitebg = false) {
+	image_cache cache(src);
+	ycbcr_histogram(cache, dst, whitebg);
+}
+
+/*
+	Standard IJG quantization tables (JPEG spec K.1) in natural order, scaled to
+	quality the way libjpeg's jpeg_set_quality does
+*/
+static const int jpeg_luma_table[64] = {
+	16, 11, 10, 16, 24, 40, 51, 61,
+	12, 12, 14, 19, 26, 58, 60, 55,
+	14, 13, 16, 24, 40, 57, 69, 56,
+	14, 17, 22, 29, 51, 87, 80, 62,
+	18, 22, 37, 56, 68, 109, 103, 77,
+	24, 35, 55, 64, 81, 104, 113, 92,
+	49, 64, 78, 87, 103, 121, 120, 101,
+	72, 92, 95, 98, 112, 100, 103, 99
+};
+static const int jpeg_chroma_table[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99
+};
+
+void jpeg_quant_table(const int *base, int quality, float *table) {
+	quality = min(max(quality, 1), 100);
+	int scale = quality < 50 ? 5000 / quality : 200 - quality*2;
+	for(int i=0; i<64; i++) {
+		table[i] = (float)min(max((base[i] * scale + 50) / 100, 1), 255);
 	}
-	//convert to float and scale to [0,1]
-	Mat lab;
-	src.convertTo(lab, CV_32F, 1.0/255.0);
-	cvtColor(lab, lab, CV_BGR2Lab);
-	//L: (0, 100) a: (-127, 127) b: (-127, 127)
+}
 
-	int abins = 1024, bbins = 1024;
-	//count frequencies and also sum L values
-	Mat hist = Mat::zeros(abins, bbins, CV_32F);
-	Mat sums = Mat::zeros(abins, bbins, CV_32F);
-	for(int i=0; i<src.rows; i++) {
-		for(int j=0; j<src.cols; j++) {
-			Vec3f pixel = lab.at<Vec3f>(i,j);
-			int A = round(4*(pixel[1]+128)), B = round(4*(pixel[2]+128));
-			hist.at<float>(A, B)++;
-			sums.at<float>(A, B) += pixel[0];
+/*
+	Push the 8x8 blocks of block rows [by_begin, by_end) of a float plane through
+	forward DCT, quantization with table and inverse DCT, in place. Samples are
+	level shifted by 128 and the result is rounded and clamped to 8-bit like a
+	decoder would. The separable passes run over rows of 8 floats, which the
+	compiler vectorizes
+*/
+void requantize_blocks(Mat &plane, const float *table, int by_begin, int by_end) {
+	//orthonormal DCT-II basis, c[u][x]
+	float c[8][8];
+	for(int u=0; u<8; u++) {
+		float alpha = u == 0 ? sqrt(1.0/8) : sqrt(2.0/8);
+		for(int x=0; x<8; x++) {
+			c[u][x] = alpha * cos((2*x+1) * u * CV_PI / 16);
 		}
 	}
 
-	//get average L value for each bin
-	divide(sums, hist, hist);
+	float block[8][8], tmp[8][8];
+	for(int by=by_begin; by<by_end; by++) {
+		for(int bx=0; bx<plane.cols/8; bx++) {
+			for(int y=0; y<8; y++) {
+				const float *row = plane.ptr<float>(by*8 + y) + bx*8;
+				for(int x=0; x<8; x++) {
+					block[y][x] = row[x] - 128;
+				}
+			}
+
+			//forward: tmp = block * c^T, block = c * tmp
+			for(int y=0; y<8; y++) {
+				for(int u=0; u<8; u++) tmp[y][u] = 0;
+				for(int x=0; x<8; x++) {
+					for(int u=0; u<8; u++) tmp[y][u] += block[y][x] * c[u][x];
+				}
+			}
+			for(int v=0; v<8; v++) {
+				for(int u=0; u<8; u++) block[v][u] = 0;
+				for(int y=0; y<8; y++) {
+					for(int u=0; u<8; u++) block[v][u] += c[v][y] * tmp[y][u];
+				}
+			}
+
+			//quantize & dequantize
+			for(int v=0; v<8; v++) {
+				for(int u=0; u<8; u++) {
+					float q = table[v*8 + u];
+					block[v][u] = cvRound(block[v][u] / q) * q;
+				}
+			}
 
-	//construct histogram image
-	int sub = 512;
-	Mat lab_histogram = Mat::zeros(abins, bbins, CV_32FC3);
-	for(int a=0; a<abins; a++) {
-		for(int b=0; b<bbins; b++) {
-			float avg = hist.at<float>(a,b);
-			if(avg>0) {
-				lab_histogram.at<Vec3f>(b, a) = Vec3f(avg, (a-sub), (b-sub));
-			} else {
-				lab_histogram.at<Vec3f>(b, a) = bgcolor;
+			//inverse: tmp = c^T * block, block = tmp * c
+			for(int y=0; y<8; y++) {
+				for(int u=0; u<8; u++) tmp[y][u] = 0;
+				for(int v=0; v<8; v++) {
+					for(int u=0; u<8; u++) tmp[y][u] += c[v][y] * block[v][u];
+				}
+			}
+			for(int y=0; y<8; y++) {
+				float *row = plane.ptr<float>(by*8 + y) + bx*8;
+				for(int x=0; x<8; x++) block[y][x] = 0;
+				for(int u=0; u<8; u++) {
+					for(int x=0; x<8; x++) block[y][x] += tmp[y][u] * c[u][x];
+				}
+				for(int x=0; x<8; x++) {
+					row[x] = min(max((float)cvRound(block[y][x] + 128), 0.0f), 255.0f);
+				}
 			}
 		}
 	}
-
-	//back to 8-bit rgb
-	cvtColor(lab_histogram, lab_histogram, CV_Lab2BGR);
-	lab_histogram.convertTo(dst, CV_8U, 255);
 }
 
 /*
-	Fast version of Lab Histogram, converting to Lab from CV_8U rather than
-	CV_32F saves a ton of time, but its less accurate.
+	What a baseline JPEG resave at quality would decode to, computed in the
+	coefficient domain: JFIF YCbCr with 4:2:0 chroma subsampling (the libjpeg
+	default), 8x8 DCT, IJG tables scaled to quality, inverse DCT and back to BGR.
+	There is no entropy coding and no compressed buffer. Edges are replicated to
+	whole 16x16 MCUs as libjpeg does. Chroma is averaged down and bilinearly
+	upsampled, close to but not bit-exact with libjpeg's fancy upsampling.
+
+	Every thread works through its MCU rows one at a time with buffers of one
+	MCU row. Upsampling an MCU row reads one chroma row of the MCU rows above
+	and below it, so the requantized chroma of the previous, current and next
+	MCU rows is kept and rolled forward
 */
-void lab_histogram_fast(Mat &src, Mat &dst, bool whitebg = false) {
-	Vec3f bgcolor = Vec3f(0,0,0);
-	if(whitebg) {
-		bgcolor = Vec3f(100,0,0);
-	}
-	//convert to float and scale to [0,1]
-	Mat lab;
-	// src.convertTo(lab, CV_32F, 1.0/255.0);
-	cvtColor(src, lab, CV_BGR2Lab);
-
-	lab.convertTo(lab, CV_32F);
-	vector<Mat> chn;
-	split(lab, chn);
-		chn[0] = (chn[0] / 255.0) * 100.0;
-		chn[1] = chn[1] - 128;
-		chn[2] = chn[2] - 128;
-	merge(chn, lab);
-	//L: (0, 100) a: (-127, 127) b: (-127, 127)
-
-	int abins = 256, bbins = 256;
-	//count frequencies and also sum L values
-	Mat hist = Mat::zeros(abins, bbins, CV_32F);
-	Mat sums = Mat::zeros(abins, bbins, CV_32F);
-	for(int i=0; i<src.rows; i++) {
-		for(int j=0; j<src.cols; j++) {
-			Vec3f pixel = lab.at<Vec3f>(i,j);
-			int A = round(1*(pixel[1]+128)), B = round(1*(pixel[2]+128));
-			hist.at<float>(A, B)++;
-			sums.at<float>(A, B) += pixel[0];
+void jpeg_block_resave(const Mat &src, int quality, Mat &resaved) {
+	float luma[64], chroma[64];
+	jpeg_quant_table(jpeg_luma_table, quality, luma);
+	jpeg_quant_table(jpeg_chroma_table, quality, chroma);
+
+	int mcu_rows = (src.rows + 15) / 16, cols = (src.cols + 15) & ~15;
+	int chroma_rows = mcu_rows * 8, chroma_cols = cols / 2;
+	resaved.create(src.size(), CV_8UC3);
+
+	//bilinear 2x upsampling taps, as resize(INTER_LINEAR) places them
+	auto taps = [](int x, int size, int &first, float &weight) {
+		float f = (x + 0.5f) * 0.5f - 0.5f;
+		first = cvFloor(f);
+		weight = f - first;
+		if(first < 0) {
+			first = 0;
+			weight = 0;
+		}
+		if(first >= size - 1) {
+			first = size - 1;
+			weight = 0;
 		}
+	};
+	vector<int> tap_x(cols);
+	vector<float> weight_x(cols);
+	for(int x=0; x<cols; x++) {
+		taps(x, chroma_cols, tap_x[x], weight_x[x]);
 	}
 
-	//get average L value for each bin
-	divide(sums, hist, hist);
+	//BGR of pixel (x, y) of the MCU padded image, edges replicated
+	auto pixel = [&](int x, int y) {
+		return src.ptr<uchar>(min(y, src.rows-1)) + 3*min(x, src.cols-1);
+	};
+
+	//JFIF YCbCr, chroma averaged over 2x2 pixels, requantized
+	auto chroma_row = [&](int m, Mat &cb, Mat &cr) {
+		for(int y=0; y<8; y++) {
+			float *pcb = cb.ptr<float>(y), *pcr = cr.ptr<float>(y);
+			for(int x=0; x<chroma_cols; x++) {
+				float sum_cb = 0, sum_cr = 0;
+				for(int k=0; k<4; k++) {
+					const uchar *p = pixel(2*x + (k & 1), m*16 + 2*y + (k >> 1));
+					sum_cb += 0.5f*p[0] - 0.331264f*p[1] - 0.168736f*p[2] + 128;
+					sum_cr += -0.081312f*p[0] - 0.418688f*p[1] + 0.5f*p[2] + 128;
+				}
+				pcb[x] = sum_cb * 0.25f;
+				pcr[x] = sum_cr * 0.25f;
+			}
+		}
+		requantize_blocks(cb, chroma, 0, 1);
+		requantize_blocks(cr, chroma, 0, 1);
+	};
+	auto luma_row = [&](int m, Mat &luma_plane) {
+		for(int y=0; y<16; y++) {
+			float *py = luma_plane.ptr<float>(y);
+			for(int x=0; x<cols; x++) {
+				const uchar *p = pixel(x, m*16 + y);
+				py[x] = 0.114f*p[0] + 0.587f*p[1] + 0.299f*p[2];
+			}
+		}
+		requantize_blocks(luma_plane, luma, 0, 2);
+	};
+
+	parallel_chunks(0, mcu_rows, [&](int begin, int end, int t) {
+		//chroma of MCU rows m-1, m and m+1
+		Mat cb[3], cr[3];
+		for(int k=0; k<3; k++) {
+			cb[k].create(8, chroma_cols, CV_32F);
+			cr[k].create(8, chroma_cols, CV_32F);
+		}
+		Mat luma_plane(16, cols, CV_32F);
 
-	//construct histogram image
-	int sub = 128;
-	Mat lab_histogram = Mat::zeros(abins, bbins, CV_32FC3);
-	for(int a=0; a<abins; a++) {
-		for(int b=0; b<bbins; b++) {
-			float avg = hist.at<float>(a,b);
-			if(avg>0) {
-				lab_histogram.at<Vec3f>(b, a) = Vec3f(avg, (a-sub), (b-sub));
-			} else {
-				lab_histogram.at<Vec3f>(b, a) = bgcolor;
+		if(begin > 0) {
+			chroma_row(begin-1, cb[0], cr[0]);
+		}
+		chroma_row(begin, cb[1], cr[1]);
+		for(int m=begin; m<end; m++) {
+			if(m+1 < mcu_rows) {
+				chroma_row(m+1, cb[2], cr[2]);
+			}
+			luma_row(m, luma_plane);
+
+			for(int y=0; y<16 && m*16 + y < src.rows; y++) {
+				int tap_y;
+				float weight_y;
+				taps(m*16 + y, chroma_rows, tap_y, weight_y);
+				//buffers and rows of the two chroma rows, the second one only counts with a weight
+				int next_y = weight_y > 0 ? tap_y + 1 : tap_y;
+				int k0 = tap_y / 8 - m + 1, k1 = next_y / 8 - m + 1;
+				const float *cb0 = cb[k0].ptr<float>(tap_y % 8), *cb1 = cb[k1].ptr<float>(next_y % 8);
+				const float *cr0 = cr[k0].ptr<float>(tap_y % 8), *cr1 = cr[k1].ptr<float>(next_y % 8);
+				const float *py = luma_plane.ptr<float>(y);
+				uchar *out = resaved.ptr<uchar>(m*16 + y);
+
+				for(int x=0; x<src.cols; x++) {
+					int sx = tap_x[x], nx = weight_x[x] > 0 ? sx + 1 : sx;
+					float wx = weight_x[x];
+					float vcb0 = cb0[sx] + (cb0[nx] - cb0[sx]) * wx, vcb1 = cb1[sx] + (cb1[nx] - cb1[sx]) * wx;
+					float vcr0 = cr0[sx] + (cr0[nx] - cr0[sx]) * wx, vcr1 = cr1[sx] + (cr1[nx] - cr1[sx]) * wx;
+					float vcb = vcb0 + (vcb1 - vcb0) * weight_y - 128;
+					float vcr = vcr0 + (vcr1 - vcr0) * weight_y - 128;
+
+					//JFIF YCbCr back to BGR
+					out[3*x] = saturate_cast<uchar>(py[x] + 1.772f*vcb);
+					out[3*x+1] = saturate_cast<uchar>(py[x] - 0.344136f*vcb - 0.714136f*vcr);
+					out[3*x+2] = saturate_cast<uchar>(py[x] + 1.402f*vcr);
+				}
 			}
+
+			swap(cb[0], cb[1]);
+			swap(cb[1], cb[2]);
+			swap(cr[0], cr[1]);
+			swap(cr[1], cr[2]);
 		}
+	});
+}
+
+/*
+	Fused ELA difference: dst = |a - b| for two 8-bit images of the same size and
+	type, plus the min, max, sum and sum of squares of dst in the same pass. This
+	is a true absolute difference, unlike a saturating a - b
+*/
+void absdiff_stats(const Mat &a, const Mat &b, Mat &dst, uchar &lo, uchar &hi, double &sum, double &sum_squares) {
+	dst.create(a.size(), a.type());
+
+	int rows = a.rows, cols = a.cols * a.channels();
+	if(a.isContinuous() && b.isContinuous() && dst.isContinuous()) {
+		cols *= rows;
+		rows = 1;
 	}
 
-	//back to 8-bit rgb
-	cvtColor(lab_histogram, lab_histogram, CV_Lab2BGR);
-	lab_histogram.convertTo(dst, CV_8U, 255);
+	uchar min_value = 255, max_value = 0;
+	unsigned long long total = 0, total_squares = 0;
+	for(int i=0; i<rows; i++) {
+		const uchar *pa = a.ptr<uchar>(i), *pb = b.ptr<uchar>(i);
+		uchar *pd = dst.ptr<uchar>(i);
+		int j = 0;
+#ifdef __SSE2__
+		__m128i zero = _mm_setzero_si128();
+		__m128i vmin = _mm_set1_epi8((char)255), vmax = zero;
+		__m128i vsum = zero, vsquares = zero;
+		for(; j<=cols-16; j+=16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(pa + j));
+			__m128i y = _mm_loadu_si128((const __m128i*)(pb + j));
+			__m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+			_mm_storeu_si128((__m128i*)(pd + j), d);
+
+			vmin = _mm_min_epu8(vmin, d);
+			vmax = _mm_max_epu8(vmax, d);
+			vsum = _mm_add_epi64(vsum, _mm_sad_epu8(d, zero));
+
+			//squares in 32-bit lanes, widened to 64-bit before they can overflow
+			__m128i d_lo = _mm_unpacklo_epi8(d, zero), d_hi = _mm_unpackhi_epi8(d, zero);
+			__m128i squares = _mm_add_epi32(_mm_madd_epi16(d_lo, d_lo), _mm_madd_epi16(d_hi, d_hi));
+			vsquares = _mm_add_epi64(vsquares, _mm_unpacklo_epi32(squares, zero));
+			vsquares = _mm_add_epi64(vsquares, _mm_unpackhi_epi32(squares, zero));
+		}
+
+		uchar lanes[16];
+		_mm_storeu_si128((__m128i*)lanes, vmin);
+		for(int k=0; k<16; k++) min_value = min(min_value, lanes[k]);
+		_mm_storeu_si128((__m128i*)lanes, vmax);
+		for(int k=0; k<16; k++) max_value = max(max_value, lanes[k]);
+
+		unsigned long long wide[2];
+		_mm_storeu_si128((__m128i*)wide, vsum);
+		total += wide[0] + wide[1];
+		_mm_storeu_si128((__m128i*)wide, vsquares);
+		total_squares += wide[0] + wide[1];
+#endif
+		for(; j<cols; j++) {
+			uchar d = pa[j] > pb[j] ? pa[j] - pb[j] : pb[j] - pa[j];
+			pd[j] = d;
+			min_value = min(min_value, d);
+			max_value = max(max_value, d);
+			total += d;
+			total_squares += d*d;
+		}
+	}
+
+	lo = min_value;
+	hi = max_value;
+	sum = (double)total;
+	sum_squares = (double)total_squares;
 }
 
+//ELA buffers of one parallel_chunks chunk
+struct ela_workspace {
+	vector<uchar> buffer; //encoded jpeg
+	vector<int> save_params;
+	Mat resaved;
+	Mat difference;
+	Mat levels; //stretch lookup table
+
+	ela_workspace() : save_params {CV_IMWRITE_JPEG_QUALITY, 90} {}
+};
+
+/*
+	Reusable ELA buffers. A call takes a set of workspaces, one per chunk index,
+	and gives it back when done. Repeated calls reuse the buffers whatever
+	threads run their chunks, calls running at the same time get separate sets
+*/
+class ela_pool {
+	private:
+		mutex lock;
+		vector< vector<ela_workspace> > sets;
+
+	public:
+		vector<ela_workspace> acquire(int slots) {
+			vector<ela_workspace> workspaces;
+			{
+				lock_guard<mutex> guard(lock);
+				if(!sets.empty()) {
+					workspaces.swap(sets.back());
+					sets.pop_back();
+				}
+			}
+			if((int)workspaces.size() < slots) {
+				workspaces.resize(slots);
+			}
+			return workspaces;
+		}
+
+		void release(vector<ela_workspace> &workspaces) {
+			lock_guard<mutex> guard(lock);
+			sets.push_back(vector<ela_workspace>());
+			sets.back().swap(workspaces);
+		}
+};
+
+static ela_pool ela_buffers;
+
 /*
 	Error Level Analysis
 	encode a jpeg with a known quality (default 90) and then subtract this image
-	from the original jpeg. Normalize the resulting image for better viewing
+	from the original jpeg. Normalize the resulting image for better viewing.
+	Several qualities share the decoded source and run their encodes in parallel.
+	ELA_DCT replaces the encode/decode round trip with jpeg_block_resave. The
+	difference, its statistics and the stretch run in one fused pass over
+	buffers reused from earlier calls (see ela_pool)
 
 	implemented from Neal Krawetz's algorithm description
 	http://hackerfactor.com/papers/bh-usa-07-krawetz-wp.pdf
 	pages 16-20
 */
-void error_level_analysis(Mat &src, Mat &dst, int quality = 90) {
-	vector<uchar> buffer;
+void error_level_analysis(Mat &src, vector<Mat> &dst, const vector<int> &qualities, vector<ela_stats> &stats, ela_engine engine = ELA_JPEG) {
+	dst.assign(qualities.size(), Mat());
+	stats.assign(qualities.size(), ela_stats());
+
+	vector<ela_workspace> workspaces = ela_buffers.acquire(get_num_threads());
+
+	auto compare = [&](int i, ela_workspace &workspace) {
+		uchar lo, hi;
+		double sum, sum_squares;
+		absdiff_stats(src, workspace.resaved, workspace.difference, lo, hi, sum, sum_squares);
+
+		double count = (double)src.total() * src.channels();
+		double mean = count > 0 ? sum / count : 0;
+		double stddev = count > 0 ? sqrt(max(sum_squares / count - mean*mean, 0.0)) : 0;
+		ela_stats s = {qualities[i], mean, (double)hi, stddev};
+		stats[i] = s;
+
+		//stretch [lo, hi] to [0, 255] for better viewing, as normalize(CV_MINMAX) would
+		Mat &levels = workspace.levels;
+		levels.create(1, 256, CV_8U);
+		double scale = hi > lo ? 255.0 / (hi - lo) : 0;
+		for(int v=0; v<256; v++) {
+			levels.at<uchar>(v) = saturate_cast<uchar>((v - lo) * scale);
+		}
+		LUT(workspace.difference, levels, dst[i]);
+	};
+
+	if(engine == ELA_DCT) { //the block kernel is parallel by itself
+		for(int i=0; i<qualities.size(); i++) {
+			jpeg_block_resave(src, qualities[i], workspaces[0].resaved);
+			compare(i, workspaces[0]);
+		}
+		ela_buffers.release(workspaces);
+		return;
+	}
 
-	vector<int> save_params(2);
-	save_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-	save_params.push_back(quality);
-	//encode as jpeg
-	imencode(".jpg", src, buffer, save_params);
+	parallel_chunks(0, qualities.size(), [&](int begin, int end, int t) {
+		//encode buffers of this chunk, reused across qualities and calls
+		ela_workspace &workspace = workspaces[t];
 
-	Mat resaved = imdecode(buffer, CV_LOAD_IMAGE_COLOR);
-	//normalize the difference for better viewing
-	normalize(abs(src - resaved), dst, 0, 255, CV_MINMAX);
+		for(int i=begin; i<end; i++) {
+			workspace.save_params[1] = qualities[i];
+			//encode as jpeg
+			imencode(".jpg", src, workspace.buffer, workspace.save_params);
+
+			imdecode(workspace.buffer, CV_LOAD_IMAGE_COLOR, &workspace.resaved);
+			compare(i, workspace);
+		}
+	});
+	ela_buffers.release(workspaces);
+}
+
+void error_level_analysis(Mat &src, Mat &dst, int quality = 90) {
+	vector<Mat> results;
+	vector<ela_stats> stats;
+	error_level_analysis(src, results, vector<int>(1, quality), stats);
+	dst = results[0];
 }
 
 /*
@@ -236,151 +956,228 @@ void error_level_analysis(Mat &src, Mat &dst, int quality = 90) {
 	colorize the image using the X and Y sobel components as angle in G and R channels
 	and magnitude of the vectors as the B channel.
 
+	the angle is atan2(x, y), so its sine and cosine are x/magnitude and
+	y/magnitude, no trig is needed. The first pass writes G and R straight to
+	8-bit and keeps the magnitude with its range, the second one stretches the
+	magnitude to [0,255] into B. Pixels without gradient get G 0.5 and R 0, as
+	atan2(0, 0) is 0
+
 	implemented from Neal Krawetz's algorithm description
 	http://blackhat.com/presentations/bh-dc-08/Krawetz/Presentation/bh-dc-08-krawetz.pdf
 	pages 60-72
 */
-void luminance_gradient(Mat &src, Mat &dst) {
-	Mat greyscale;
-	cvtColor(src, greyscale, CV_BGR2GRAY);
+void luminance_gradient(image_cache &cache, Mat &dst) {
+	const Mat &greyscale = cache.grayscale();
 
-	//get sobel in x and y directions
-	Size size = src.size();
+	//get sobel in x and y directions, exact in 16 bits for 8-bit input
 	Mat sobelX;
 	Mat sobelY;
 
-	Sobel(greyscale, sobelX, CV_32F, 1, 0);
-	Sobel(greyscale, sobelY, CV_32F, 0, 1);
-
-	dst = Mat::zeros(size, CV_32FC3);
-
-	int rows = dst.rows;
-	int cols = dst.cols;
-	if(dst.isContinuous()) {
-		cols = rows * cols;
-		rows = 1;
-	}
+	Sobel(greyscale, sobelX, CV_16S, 1, 0);
+	Sobel(greyscale, sobelY, CV_16S, 0, 1);
+
+	int rows = greyscale.rows;
+	int cols = greyscale.cols;
+	Mat magnitude(rows, cols, CV_32F);
+	dst.create(rows, cols, CV_8UC3);
+
+	//G, R and the magnitude, with its min and max per thread
+	int threads = get_num_threads();
+	vector<float> lows(threads, FLT_MAX), highs(threads, 0);
+	parallel_chunks(0, rows, [&](int begin, int end, int t) {
+		float lo = FLT_MAX, hi = 0;
+		for(int i=begin; i<end; i++) {
+			const short *sx = sobelX.ptr<short>(i);
+			const short *sy = sobelY.ptr<short>(i);
+			float *mag = magnitude.ptr<float>(i);
+			uchar *ptr = dst.ptr<uchar>(i);
+			int j = 0;
+#ifdef __SSE2__
+			__m128 vlo = _mm_set1_ps(FLT_MAX), vhi = _mm_setzero_ps();
+			__m128 zero = _mm_setzero_ps(), half = _mm_set1_ps(0.5f), scale = _mm_set1_ps(255.0f);
+			for(; j<=cols-4; j+=4) {
+				//sign extend 4 shorts to floats
+				__m128i x16 = _mm_loadl_epi64((const __m128i*)(sx + j));
+				__m128i y16 = _mm_loadl_epi64((const __m128i*)(sy + j));
+				__m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x16, x16), 16));
+				__m128 y = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(y16, y16), 16));
+
+				__m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)));
+				_mm_storeu_ps(mag + j, m);
+				vlo = _mm_min_ps(vlo, m);
+				vhi = _mm_max_ps(vhi, m);
+
+				//-x/m/2 + 0.5 and -y/m/2 + 0.5, masked to 0.5 and 0 where m is 0
+				__m128 nonzero = _mm_cmpgt_ps(m, zero);
+				__m128 inverse = _mm_and_ps(nonzero, _mm_div_ps(half, m));
+				__m128 g = _mm_sub_ps(half, _mm_mul_ps(x, inverse));
+				__m128 r = _mm_and_ps(nonzero, _mm_sub_ps(half, _mm_mul_ps(y, inverse)));
+
+				int gs[4], rs[4];
+				_mm_storeu_si128((__m128i*)gs, _mm_cvtps_epi32(_mm_mul_ps(g, scale)));
+				_mm_storeu_si128((__m128i*)rs, _mm_cvtps_epi32(_mm_mul_ps(r, scale)));
+				for(int k=0; k<4; k++) {
+					ptr[3*(j+k)+1] = (uchar)gs[k];
+					ptr[3*(j+k)+2] = (uchar)rs[k];
+				}
+			}
 
-	for(int i=0; i<rows; i++) {
-		Vec3f *ptr = dst.ptr<Vec3f>(i);
-		float *sx = sobelX.ptr<float>(i);
-		float *sy = sobelY.ptr<float>(i);
-		for(int j=0; j<cols; j++) {
-			float angle = atan2(sx[j], sy[j]);
-			Vec3f pixel;
-			pixel[0] = sqrt((sx[j]*sx[j]) + (sy[j]*sy[j])); //B: magnitude of the x and y derivatives
-			pixel[1] = (-sin(angle) / 2.0 + 0.5); //G: -sin(angle) mapped to [0,1]
-			pixel[2] = (-cos(angle) / 2.0 + 0.5); //R: -cos(angle) mapped to [0,1]
-			ptr[j] = pixel;
+			float lanes[4];
+			_mm_storeu_ps(lanes, vlo);
+			for(int k=0; k<4; k++) lo = min(lo, lanes[k]);
+			_mm_storeu_ps(lanes, vhi);
+			for(int k=0; k<4; k++) hi = max(hi, lanes[k]);
+#endif
+			for(; j<cols; j++) {
+				float x = sx[j], y = sy[j];
+				float m = sqrt(x*x + y*y); //B: magnitude of the x and y derivatives
+				mag[j] = m;
+				lo = min(lo, m);
+				hi = max(hi, m);
+
+				float g = 0.5f, r = 0;
+				if(m > 0) {
+					g = 0.5f - x * (0.5f / m); //G: -sin(angle) mapped to [0,1]
+					r = 0.5f - y * (0.5f / m); //R: -cos(angle) mapped to [0,1]
+				}
+				ptr[3*j+1] = saturate_cast<uchar>(g * 255);
+				ptr[3*j+2] = saturate_cast<uchar>(r * 255);
+			}
 		}
-	}
-
-	vector<Mat> ch;
-	split(dst, ch);
-		normalize(ch[0], ch[0], 0, 1, CV_MINMAX);
-	merge(ch, dst);
+		lows[t] = lo;
+		highs[t] = hi;
+	});
+
+	//stretch the magnitude to [0,255], a flat image is all 0 like CV_MINMAX
+	float lo = *min_element(lows.begin(), lows.end());
+	float hi = *max_element(highs.begin(), highs.end());
+	float scale = hi > lo ? 255.0f / (hi - lo) : 0;
+	parallel_chunks(0, rows, [&](int begin, int end, int t) {
+		for(int i=begin; i<end; i++) {
+			const float *mag = magnitude.ptr<float>(i);
+			uchar *ptr = dst.ptr<uchar>(i);
+			for(int j=0; j<cols; j++) {
+				ptr[3*j] = saturate_cast<uchar>((mag[j] - lo) * scale);
+			}
+		}
+	});
+}
 
-	dst.convertTo(dst, CV_8U, 255);
+void luminance_gradient(Mat &src, Mat &dst) {
+	image_cache cache(src);
+	luminance_gradient(cache, dst);
 }
 
 /*
 	Turn all pixels into the average of the magnitude of its cross-shaped neighbors.
 
-	implemented from https://infohost.nmt.edu/~schlake/ela/src/hfalg.c
-*/
-void average_distance(Mat &src, Mat &dst) {
-	//average of cross-shaped neighbors filter
-	Matx33f filter(0, 0.25, 0,
-			0.25, 0, 0.25,
-			0, 0.25, 0);
-
-	src.convertTo(dst, CV_32F, 1.0/255.0);
+	the distance to the neighbor average is |4c - (n + s + w + e)| / 4, kept as
+	the exact 16-bit numerator since the /4 cancels out in the min-max stretch.
+	The first pass computes it per channel straight from the 8-bit image, with
+	the reflect-101 border of filter2D, along with its min and max per thread.
+	The second one stretches it to [0,255]
 
-	//apply filter
-	Mat filtered;
-	filter2D(dst, filtered, CV_32F, filter);
-	normalize(abs(dst - filtered), dst, 0, 1, CV_MINMAX);
-	dst.convertTo(dst, CV_8U, 255);
-}
-
-/*
-	Extract given marker from jpeg file.
+	implemented from https://infohost.nmt.edu/~schlake/ela/src/hfalg.c
 */
-int extract_jpeg_marker(const char* filename, char marker, vector<char*> &list) {
-	//open file and get started
-	ifstream in(filename, ios::binary);
+void average_distance(image_cache &cache, Mat &dst) {
+	const Mat &image = cache.source();
+
+	int rows = image.rows;
+	int cols = image.cols;
+	int cn = image.channels();
+	int width = cols * cn;
+	Mat distance(rows, width, CV_16U);
+
+	int threads = get_num_threads();
+	vector<ushort> lows(threads, USHRT_MAX), highs(threads, 0);
+	parallel_chunks(0, rows, [&](int begin, int end, int t) {
+		ushort lo = USHRT_MAX, hi = 0;
+		for(int i=begin; i<end; i++) {
+			//reflect-101 neighbor rows, the row itself on a 1 row image
+			int up = i > 0 ? i-1 : min(1, rows-1), down = i < rows-1 ? i+1 : max(rows-2, 0);
+			const uchar *c = image.ptr<uchar>(i), *n = image.ptr<uchar>(up), *s = image.ptr<uchar>(down);
+			ushort *d = distance.ptr<ushort>(i);
+
+			auto edge = [&](int j) {
+				//reflect-101 neighbor columns of sample j
+				int x = j / cn;
+				int w = j + (x > 0 ? -cn : (cols > 1 ? cn : 0));
+				int e = j + (x < cols-1 ? cn : (cols > 1 ? -cn : 0));
+				int value = abs(4*c[j] - (n[j] + s[j] + c[w] + c[e]));
+				d[j] = (ushort)value;
+				lo = min(lo, d[j]);
+				hi = max(hi, d[j]);
+			};
+
+			//first pixel, interior, last pixel
+			for(int j=0; j<min(cn, width); j++) edge(j);
+			int j = cn, last = width - cn;
+#ifdef __SSE2__
+			__m128i zero = _mm_setzero_si128();
+			__m128i vlo = _mm_set1_epi16(SHRT_MAX), vhi = zero;
+			for(; j<=last-16; j+=16) {
+				__m128i vc = _mm_loadu_si128((const __m128i*)(c + j));
+				__m128i vn = _mm_loadu_si128((const __m128i*)(n + j));
+				__m128i vs = _mm_loadu_si128((const __m128i*)(s + j));
+				__m128i vw = _mm_loadu_si128((const __m128i*)(c + j - cn));
+				__m128i ve = _mm_loadu_si128((const __m128i*)(c + j + cn));
+
+				//low and high 8 samples widened to 16 bits, all values fit in [-1020, 1020]
+				__m128i centers[2] = {_mm_slli_epi16(_mm_unpacklo_epi8(vc, zero), 2), _mm_slli_epi16(_mm_unpackhi_epi8(vc, zero), 2)};
+				__m128i sums[2] = {
+					_mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(vn, zero), _mm_unpacklo_epi8(vs, zero)), _mm_add_epi16(_mm_unpacklo_epi8(vw, zero), _mm_unpacklo_epi8(ve, zero))),
+					_mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(vn, zero), _mm_unpackhi_epi8(vs, zero)), _mm_add_epi16(_mm_unpackhi_epi8(vw, zero), _mm_unpackhi_epi8(ve, zero)))
+				};
+				for(int half=0; half<2; half++) {
+					__m128i diff = _mm_max_epi16(_mm_sub_epi16(centers[half], sums[half]), _mm_sub_epi16(sums[half], centers[half]));
+					_mm_storeu_si128((__m128i*)(d + j + 8*half), diff);
+					vlo = _mm_min_epi16(vlo, diff);
+					vhi = _mm_max_epi16(vhi, diff);
+				}
+			}
 
-	// first two bytes must be 0xffd8 for jpeg format
-	char buffer[2];
-	in.read(buffer, 2);
-	if(buffer[0] != (char)0xFF && buffer[1] != (char)0xD8) {
-		//not jpeg
-		return -2;
-	}
-	/*cout << "First Two: " << endl;
-	cout << "\t" << hex << (unsigned short)buffer[0] << endl;
-	cout << "\t" << hex << (unsigned short)buffer[1] << endl;*/
-	
-	in.read(buffer, 2);
-	if(buffer[0] != (char)0xFF) {
-		//jpeg but corrupt?
-		return -1;
-	}
-	/*cout << "Third: ";
-	cout << "\t" << hex << (unsigned short)buffer[0] << endl;*/
-
-	/**
-	 * loop until:
-	 * - end of file
-	 * - end of image 0xd9
-	 * - hit image data (no headers after image data starts)
-	 */
-	bool compressed = false;
-	while(buffer[1] != (char)0xD9 && !compressed && in.tellg() != -1) {
-		/*cout << "Marker:\t" << hex << (unsigned short)buffer[1] << endl;*/
-		//check that segment marker is not a restart marker
-		if(buffer[1] < (char)0xD0 || buffer[1] > (char)0xD7) {
-			//next two bytes are the size of the segment
-			char size[2];
-			in.read(size, 2);
-			/*cout << "Size:\t" << hex << (unsigned short)size[0] << endl << "\t" << hex << (unsigned short)size[1] << endl;*/
-			//convert to short
-			unsigned short size_s = size[0];
-			size_s <<= 8;
-			size_s |= size[1] & 0x00FF; //this last bit mask was what was missing all along! why this way?
-
-			/*cout << "+-+-+-+-+-+-+-+-+-+" << endl;
-			cout << "Size: " << dec << size_s << endl;*/
-
-			//read segment
-			//segment size includes the previous two size bytes (i think)
-			char *segdata = new char[size_s-2];
-			in.read(segdata, size_s-2);
-
-			//DQT marker 0xdb
-			if(buffer[1] == marker) {
-				list.push_back(segdata);
-			}
-			/*cout << "+-+-+-+-+-+-+-+-+-+" << endl;*/
-		}
-
-		//if we see start of scan (SOS 0xda) that means its just image data from here on
-		if(buffer[1] == (char)0xDA) {
-			compressed = true;
-		} else {
-			//read the next two bytes, first one must be 0xff start of segment
-			in.read(buffer, 2);
-			if(buffer[0] != (char)0xFF) { //something wrong with this jpeg
-				return -1;
+			short lanes[8];
+			_mm_storeu_si128((__m128i*)lanes, vlo);
+			for(int k=0; k<8; k++) lo = min(lo, (ushort)lanes[k]);
+			_mm_storeu_si128((__m128i*)lanes, vhi);
+			for(int k=0; k<8; k++) hi = max(hi, (ushort)lanes[k]);
+#endif
+			for(; j<last; j++) {
+				int value = abs(4*c[j] - (n[j] + s[j] + c[j-cn] + c[j+cn]));
+				d[j] = (ushort)value;
+				lo = min(lo, d[j]);
+				hi = max(hi, d[j]);
+			}
+			for(j=max(last, cn); j<width; j++) edge(j);
+		}
+		lows[t] = min(lows[t], lo);
+		highs[t] = max(highs[t], hi);
+	});
+
+	//stretch to [0,255], a flat image is all 0 like CV_MINMAX
+	int lo = *min_element(lows.begin(), lows.end());
+	int hi = *max_element(highs.begin(), highs.end());
+	float scale = hi > lo ? 255.0f / (hi - lo) : 0;
+	dst.create(rows, cols, CV_MAKETYPE(CV_8U, cn));
+	parallel_chunks(0, rows, [&](int begin, int end, int t) {
+		for(int i=begin; i<end; i++) {
+			const ushort *d = distance.ptr<ushort>(i);
+			uchar *ptr = dst.ptr<uchar>(i);
+			for(int j=0; j<width; j++) {
+				ptr[j] = saturate_cast<uchar>((d[j] - lo) * scale);
 			}
 		}
-	} //file reading complete
+	});
+}
 
-	return list.size();
+void average_distance(Mat &src, Mat &dst) {
+	image_cache cache(src);
+	average_distance(cache, dst);
 }
 
 /*
-	Estimate jpeg quality from extracted QTs (Quantization Tables)
+	Estimate jpeg quality from the QTs (Quantization Tables) of the DQT segments
+	in the index
 
 	uses estimation method in Neal Krawetz's jpegquality tool
 	http://www.hackerfactor.com/src/jpegquality.c
@@ -388,12 +1185,28 @@ int extract_jpeg_marker(const char* filename, char marker, vector<char*> &list)
 	also uses estimation tables from Imagemagick codebase
 	http://trac.imagemagick.org/browser/ImageMagick/trunk/coders/jpeg.c
 */
-int estimate_jpeg_quality(const char* filename, vector<qtable> &qtables, vector<double> &quality_estimates) {
-	vector<char*> dqt_tables;
+int estimate_jpeg_quality(const jpeg_index &index, vector<qtable> &qtables, vector<double> &quality_estimates) {
+	if(index.status() < 1) {
+		return index.status();
+	}
 
-	int num_segments = extract_jpeg_marker(filename, 0xDB, dqt_tables);
-	if(num_segments < 1) {
-		return num_segments;
+	//every table of every DQT segment, as a view of its first byte
+	vector<const unsigned char*> dqt_tables;
+	vector<const jpeg_segment*> dqt_segments = index.find(0xDB);
+	for(size_t k=0; k<dqt_segments.size(); k++) {
+		const unsigned char *data = dqt_segments[k]->data;
+		size_t length = dqt_segments[k]->length, pos = 0;
+		while(pos < length) {
+			size_t table_length = 1 + ((data[pos] >> 4) ? 128 : 64); //8 or 16-bit values
+			if(pos + table_length > length) {
+				break;
+			}
+			dqt_tables.push_back(data + pos);
+			pos += table_length;
+		}
+	}
+	if(dqt_tables.empty()) {
+		return 0;
 	}
 
 	Mat zigzag8 = (Mat_<int>(64, 1) << 0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42, 3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18, 24, 31, 40, 44, 53, 10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60, 21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63);
@@ -402,16 +1215,22 @@ int estimate_jpeg_quality(const char* filename, vector<qtable> &qtables, vector<
 	for(int k=0; k<dqt_tables.size(); k++) {
 		Mat dqt(8,8, CV_32F);
 		//precision and index is packed into this first byte
-		char precision_index = dqt_tables[k][0];
+		unsigned char precision_index = dqt_tables[k][0];
 		int precision, index;
-		index = precision_index & 0x0F; //first 4 bits
-		precision = (precision_index & 0xF0) & 0x0F; //last 4 bits
+		index = precision_index & 0x0F; //low 4 bits
+		precision = precision_index >> 4; //high 4 bits, 0 = 8-bit, 1 = 16-bit values
+
+		//table values in zigzag order
+		int zz[64];
+		for(int i=0; i<64; i++) {
+			zz[i] = precision ? (dqt_tables[k][1+2*i] << 8) | dqt_tables[k][2+2*i] : dqt_tables[k][1+i];
+		}
 
 		//load the rest of the segment data to DQT matrix - in zigzag order
 		for(int i=0; i<8; i++) {
 			for(int j=0; j<8; j++) {
 				//dqt.at<float>(i, j) = segdata[i*8+j]; //non-zigzag order
-				dqt.at<float>(i, j) = dqt_tables[k][zigzag8.at<int>(i*8+j)+1];
+				dqt.at<float>(i, j) = zz[zigzag8.at<int>(i*8+j)];
 			}
 		}
 		CvScalar sum = cv::sum(dqt);
@@ -420,9 +1239,9 @@ int estimate_jpeg_quality(const char* filename, vector<qtable> &qtables, vector<
 		//ImageMagick initial qval
 		double im_qval;
 		if(k==1) {
-			im_qval = dqt_tables[k][2] + dqt_tables[k][53];
+			im_qval = zz[1] + zz[52];
 		} else {
-			im_qval = dqt_tables[k][0] + dqt_tables[k][63];
+			im_qval = precision_index + zz[62];
 		}
 
 		//push it to vector
@@ -549,28 +1368,771 @@ int estimate_jpeg_quality(const char* filename, vector<qtable> &qtables, vector<
 	return num_qtables;
 }
 
+int estimate_jpeg_quality(const char* filename, vector<qtable> &qtables, vector<double> &quality_estimates) {
+	vector<unsigned char> bytes;
+	if(!read_file(filename, bytes)) {
+		return -2;
+	}
+
+	jpeg_index index(bytes.empty() ? NULL : &bytes[0], bytes.size());
+	return estimate_jpeg_quality(index, qtables, quality_estimates);
+}
+
+/*
+	Radix sort for DCT Copy-Move detection. Sorts an index lexicographically by
+	fixed-length byte keys, which are stored back to back in one flat buffer,
+	"length" bytes each. This is an LSD radix sort, one counting pass per key
+	byte, so it runs in linear time. The sort is stable, identical keys stay in
+	ascending index order.
+
+	Each pass is split across the worker threads: every thread counts the byte
+	over its slice of the index, the counts are turned into per-thread bucket
+	offsets (bucket-major, so the order of the slices is kept) and every thread
+	scatters its own slice
+*/
+void radix_sort_keys(const uchar *keys, int length, vector<int> &index) {
+	int n = index.size();
+	if(n < 2) return;
+
+	int threads = get_num_threads();
+
+	//histograms for every key byte, each thread sweeps its part of the keys
+	vector< vector<size_t> > partial(threads);
+	parallel_chunks(0, n, [&](int begin, int end, int t) {
+		vector<size_t> &counts = partial[t];
+		counts.assign((size_t)length * 256, 0);
+		const uchar *key = keys + (size_t)begin * length;
+		for(int i=begin; i<end; i++) {
+			for(int d=0; d<length; d++) {
+				counts[d*256 + key[d]]++;
+			}
+			key += length;
+		}
+	});
+
+	vector<size_t> counts((size_t)length * 256, 0);
+	for(int t=0; t<threads; t++) {
+		for(size_t i=0; i<partial[t].size(); i++) {
+			counts[i] += partial[t][i];
+		}
+	}
+
+	vector<int> buffer(n);
+	vector<size_t> offsets((size_t)threads * 256);
+	for(int d=length-1; d>=0; d--) {
+		//all keys share this byte, the pass would not move anything
+		if(counts[d*256 + keys[d]] == (size_t)n) continue;
+
+		//count the byte over every thread's slice of the current order
+		fill(offsets.begin(), offsets.end(), 0);
+		parallel_chunks(0, n, [&](int begin, int end, int t) {
+			size_t *count = &offsets[t*256];
+			for(int i=begin; i<end; i++) {
+				count[keys[(size_t)index[i] * length + d]]++;
+			}
+		});
+
+		//bucket start offsets for every thread
+		size_t offset = 0;
+		for(int b=0; b<256; b++) {
+			for(int t=0; t<threads; t++) {
+				size_t c = offsets[t*256 + b];
+				offsets[t*256 + b] = offset;
+				offset += c;
+			}
+		}
+
+		parallel_chunks(0, n, [&](int begin, int end, int t) {
+			size_t *offset = &offsets[t*256];
+			for(int i=begin; i<end; i++) {
+				int idx = index[i];
+				buffer[offset[keys[(size_t)idx * length + d]]++] = idx;
+			}
+		});
+		index.swap(buffer);
+	}
+}
+
+/*
+	Partial DCT for Copy-Move detection. Computes only the top-left retain x retain
+	coefficients of the (orthonormal, same as cv::dct) blocksize x blocksize DCT.
+	Blocks sit on a grid with "stride" pixels between them, and this handles the
+	grid rows [y_begin, y_end).
+
+	The DCT is separable. Every image row is correlated with the retained
+	horizontal basis vectors once, and those row results are shared by all the
+	blocks covering that row. The vertical basis vectors are then applied over
+	blocksize row results. Inner loops run over contiguous x so the compiler can
+	vectorize them. Coefficients are quantized by qcoeff and written to features,
+	retain*retain bytes per block in row-major order
+*/
+void dct_features(const Mat &grayscale, int blocksize, int stride, int retain, double qcoeff, int y_begin, int y_end, uchar *features) {
+	int blocks_width = (grayscale.cols-blocksize) / stride + 1;
+	int subm_limit = retain * retain;
+	int row_begin = y_begin * stride;
+	int band_rows = (y_end - 1 - y_begin) * stride + blocksize;
+
+	//DCT-II basis vectors, only the retained frequencies
+	vector<float> basis(retain * blocksize);
+	for(int k=0; k<retain; k++) {
+		double alpha = sqrt((k == 0 ? 1.0 : 2.0) / blocksize);
+		for(int n=0; n<blocksize; n++) {
+			basis[k*blocksize + n] = alpha * cos(CV_PI * (2*n+1) * k / (2.0*blocksize));
+		}
+	}
+
+	//horizontal pass: rowdct[v] holds frequency v for every (row, block column)
+	vector<float> rowdct((size_t)retain * band_rows * blocks_width, 0.f);
+	for(int v=0; v<retain; v++) {
+		for(int r=0; r<band_rows; r++) {
+			const uchar *row = grayscale.ptr<uchar>(row_begin + r);
+			float *out = &rowdct[((size_t)v * band_rows + r) * blocks_width];
+			for(int n=0; n<blocksize; n++) {
+				float coef = basis[v*blocksize + n];
+				const uchar *in = row + n;
+				if(stride == 1) {
+					for(int x=0; x<blocks_width; x++) {
+						out[x] += coef * in[x];
+					}
+				} else {
+					for(int x=0; x<blocks_width; x++) {
+						out[x] += coef * in[x*stride];
+					}
+				}
+			}
+		}
+	}
+
+	//vertical pass over blocksize row results, then quantize
+	vector<float> acc(blocks_width);
+	for(int y=y_begin; y<y_end; y++) {
+		uchar *block_features = features + (size_t)(y - y_begin) * blocks_width * subm_limit;
+		int r = (y - y_begin) * stride;
+		for(int u=0; u<retain; u++) {
+			for(int v=0; v<retain; v++) {
+				fill(acc.begin(), acc.end(), 0.f);
+				for(int m=0; m<blocksize; m++) {
+					float coef = basis[u*blocksize + m];
+					const float *in = &rowdct[((size_t)v * band_rows + r + m) * blocks_width];
+					for(int x=0; x<blocks_width; x++) {
+						acc[x] += coef * in[x];
+					}
+				}
+
+				uchar *out = block_features + u*retain + v;
+				for(int x=0; x<blocks_width; x++) {
+					out[(size_t)x * subm_limit] = saturate_cast<uchar>(acc[x] / qcoeff);
+				}
+			}
+		}
+	}
+}
+
 /*
-	Lexicographically sorts an index for DCT Copy-Move detection
+	PCA features for Copy-Move detection, after "Exposing Digital Forgeries by
+	Detecting Duplicated Image Regions" by Alin C Popescu and Hany Farid.
+	components holds the principal components as rows of blocksize*blocksize
+	floats, offsets their projections of the mean block.
+
+	Projecting every block of the grid rows [y_begin, y_end) onto a component is
+	a correlation of the image with that component as a blocksize x blocksize
+	kernel, so filter2D does the heavy lifting. Projections are quantized by
+	qcoeff like the DCT coefficients, centered on 128, one byte per component
 */
-template<class T> class sorter {
+void pca_features(const Mat &grayscale, int blocksize, int stride, const Mat &components, const vector<float> &offsets, double qcoeff, int y_begin, int y_end, uchar *features) {
+	int blocks_width = (grayscale.cols-blocksize) / stride + 1;
+	int length = components.rows;
+	int row_begin = y_begin * stride;
+	int band_rows = (y_end - 1 - y_begin) * stride + blocksize;
+	Mat band = grayscale.rowRange(row_begin, row_begin + band_rows);
+
+	Mat projection;
+	for(int k=0; k<length; k++) {
+		Mat kernel = components.row(k).reshape(1, blocksize);
+		filter2D(band, projection, CV_32F, kernel, Point(0,0), 0, BORDER_CONSTANT);
+
+		for(int y=y_begin; y<y_end; y++) {
+			const float *row = projection.ptr<float>((y - y_begin) * stride);
+			uchar *out = features + (size_t)(y - y_begin) * blocks_width * length + k;
+			for(int x=0; x<blocks_width; x++) {
+				out[(size_t)x * length] = saturate_cast<uchar>((row[x*stride] - offsets[k]) / qcoeff + 128);
+			}
+		}
+	}
+}
+
+/*
+	Fit the principal components of the blocksize x blocksize blocks of an image
+	for pca_features, on an evenly spaced sample of at most 20000 blocks
+*/
+void fit_block_pca(const Mat &grayscale, int blocksize, int max_components, Mat &components, vector<float> &offsets) {
+	int blocks_height = grayscale.rows-blocksize+1;
+	int blocks_width = grayscale.cols-blocksize+1;
+	int total_blocks = blocks_height * blocks_width;
+	int samples = min(total_blocks, 20000);
+
+	Mat data(samples, blocksize*blocksize, CV_32F);
+	for(int i=0; i<samples; i++) {
+		int block = (int)((long long)total_blocks * i / samples);
+		int x = block % blocks_width;
+		int y = block / blocks_width;
+		float *row = data.ptr<float>(i);
+		for(int r=0; r<blocksize; r++) {
+			const uchar *pixels = grayscale.ptr<uchar>(y + r) + x;
+			copy(pixels, pixels + blocksize, row + r*blocksize);
+		}
+	}
+
+	PCA pca(data, Mat(), CV_PCA_DATA_AS_ROW, max_components);
+	components = pca.eigenvectors;
+
+	offsets.resize(components.rows);
+	for(int k=0; k<components.rows; k++) {
+		offsets[k] = components.row(k).dot(pca.mean);
+	}
+}
+
+/*
+	Block feature engines for Copy-Move detection. extract() fills the fixed-width
+	keys ("length" bytes per block) of the grid rows [y_begin, y_end) of a CV_8U
+	image, the image may be a column range of the one the engine was made for.
+	workspace(rows) is an upper bound of the memory extract() allocates for a
+	band of that many grid rows
+*/
+enum copy_move_engine {CM_DCT, CM_PCA};
+
+struct feature_engine {
+	int length;
+	function<void(const Mat &, int, int, uchar *)> extract;
+	function<size_t(int)> workspace;
+};
+
+feature_engine make_feature_engine(copy_move_engine engine, const Mat &grayscale, int blocksize, int stride, int retain, double qcoeff) {
+	feature_engine features;
+	if(engine == CM_PCA) {
+		//2*retain components, half the key of the DCT engine by default
+		Mat components;
+		vector<float> offsets;
+		fit_block_pca(grayscale, blocksize, min(2 * retain, blocksize * blocksize), components, offsets);
+
+		features.length = components.rows;
+		features.extract = [=](const Mat &image, int y_begin, int y_end, uchar *out) {
+			pca_features(image, blocksize, stride, components, offsets, qcoeff, y_begin, y_end, out);
+		};
+		//the float projection of the band and the DFT buffers of filter2D
+		int cols = grayscale.cols;
+		features.workspace = [=](int rows) {
+			return 4 * (size_t)((rows - 1) * stride + blocksize) * cols * sizeof(float);
+		};
+	} else {
+		features.length = retain * retain;
+		features.extract = [=](const Mat &image, int y_begin, int y_end, uchar *out) {
+			dct_features(image, blocksize, stride, retain, qcoeff, y_begin, y_end, out);
+		};
+		//the row results of the horizontal pass
+		int blocks_width = (grayscale.cols - blocksize) / stride + 1;
+		features.workspace = [=](int rows) {
+			return retain * (size_t)((rows - 1) * stride + blocksize) * blocks_width * sizeof(float);
+		};
+	}
+	return features;
+}
+
+/*
+	Shift-vector histogram for Copy-Move detection. An open addressing hash map
+	(linear probing) from a (dx, dy) shift vector to its number of votes, so the
+	memory used grows with the number of distinct shifts instead of the image size
+*/
+class shift_histogram {
 	private:
-		const vector<T> &values;
+		static const unsigned long long empty = ~0ULL;
+
+		vector<unsigned long long> keys;
+		vector<int> counts;
+		size_t used;
+
+		static unsigned long long pack(int dx, int dy) {
+			return ((unsigned long long)(unsigned int)dx << 32) | (unsigned int)dy;
+		}
+
+		//slot for the key, either the one holding it or the empty one to insert into
+		size_t find(unsigned long long key) const {
+			size_t mask = keys.size() - 1;
+			size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+			while(keys[slot] != empty && keys[slot] != key) {
+				slot = (slot + 1) & mask;
+			}
+			return slot;
+		}
+
+		void add_key(unsigned long long key, int votes) {
+			//keep the load factor under 1/2
+			if(2 * (used + 1) > keys.size()) {
+				grow();
+			}
+
+			size_t slot = find(key);
+			if(keys[slot] == empty) {
+				keys[slot] = key;
+				used++;
+			}
+			counts[slot] += votes;
+		}
+
+		void grow() {
+			vector<unsigned long long> old_keys(keys.size() * 2, empty);
+			vector<int> old_counts(counts.size() * 2, 0);
+			old_keys.swap(keys);
+			old_counts.swap(counts);
+			for(size_t i=0; i<old_keys.size(); i++) {
+				if(old_keys[i] != empty) {
+					size_t slot = find(old_keys[i]);
+					keys[slot] = old_keys[i];
+					counts[slot] = old_counts[i];
+				}
+			}
+		}
 
 	public:
-		sorter(const vector<T> &v) : values(v) {}
+		shift_histogram() : keys(64, empty), counts(64, 0), used(0) {}
 
-		bool operator()(int a, int b) {
-			unsigned char *v_a = (unsigned char*)(values[a].data);
-			unsigned char *v_b = (unsigned char*)(values[b].data);
+		void add(int dx, int dy, int votes = 1) {
+			add_key(pack(dx, dy), votes);
+		}
 
-			int limit = values[a].cols * values[a].rows;
+		int count(int dx, int dy) const {
+			size_t slot = find(pack(dx, dy));
+			return keys[slot] == empty ? 0 : counts[slot];
+		}
 
-			return lexicographical_compare(v_a, v_a+limit, v_b, v_b+limit);
+		void merge(const shift_histogram &other) {
+			for(size_t i=0; i<other.keys.size(); i++) {
+				if(other.keys[i] != empty) {
+					add_key(other.keys[i], other.counts[i]);
+				}
+			}
 		}
 };
 
+const unsigned long long shift_histogram::empty;
+
+/*
+	A pair of blocks with identical features, as indices into the block grid
+*/
+struct block_match {
+	int a, b;
+};
+
 /*
-	Copy-Move detection using DCT.
+	Votes a shift vector needs before its blocks are painted. 10 is tuned for a
+	search at every pixel, a grid with "stride" pixels between blocks sees
+	stride^2 fewer positions of the same clone
+*/
+int copy_move_votes(int stride) {
+	int positions = stride * stride;
+	return max(2, (10 + positions - 1) / positions);
+}
+
+/*
+	Shift vector between two blocks of the block grid, with a non-negative x so
+	that both orders of a pair vote for the same shift
+*/
+Point grid_shift(int a, int b, int blocks_width) {
+	Point cur, next, shift;
+	cur.x = a % blocks_width;
+	cur.y = a / blocks_width;
+
+	next.x = b % blocks_width;
+	next.y = b / blocks_width;
+
+	shift = cur - next;
+	if(shift.x < 0) shift *= -1;
+
+	return shift;
+}
+
+/*
+	Append the keys and block grid indices of the grid rows [y, y_end) to features
+	and positions. If there is a candidate mask, only the candidate blocks are
+	kept and the engine only runs over the columns that hold them
+*/
+void extract_band(const Mat &grayscale, int blocksize, int stride, const feature_engine &engine, const Mat &candidates, int y, int y_end, vector<uchar> &features, vector<int> &positions) {
+	int blocks_width = (grayscale.cols-blocksize) / stride + 1;
+	int length = engine.length;
+
+	int x_begin = 0, x_end = blocks_width;
+	if(!candidates.empty()) {
+		x_begin = blocks_width;
+		x_end = 0;
+		for(int i=y; i<y_end; i++) {
+			const uchar *mask = candidates.ptr<uchar>(i);
+			for(int j=0; j<blocks_width; j++) {
+				if(mask[j]) {
+					x_begin = min(x_begin, j);
+					x_end = max(x_end, j+1);
+				}
+			}
+		}
+		if(x_begin >= x_end) return;
+	}
+
+	int width = x_end - x_begin;
+	vector<uchar> tmp((size_t)(y_end - y) * width * length);
+	Mat columns = grayscale.colRange(x_begin * stride, (x_end - 1) * stride + blocksize);
+	engine.extract(columns, y, y_end, &tmp[0]);
+
+	for(int i=y; i<y_end; i++) {
+		const uchar *mask = candidates.empty() ? NULL : candidates.ptr<uchar>(i);
+		for(int j=x_begin; j<x_end; j++) {
+			if(!mask || mask[j]) {
+				const uchar *feature = &tmp[((size_t)(i - y) * width + (j - x_begin)) * length];
+				features.insert(features.end(), feature, feature + length);
+				positions.push_back(i * blocks_width + j);
+			}
+		}
+	}
+}
+
+/*
+	Band height (in grid rows) and number of bands extracted at once, so that
+	feature extraction stays within budget bytes (0 = no limit). A band costs the
+	engine's workspace plus its keys and positions twice, the extract_band output
+	and the buffer it is appended to. Bands get lower first, down to 16 grid rows,
+	then fewer of them run at once, then they go down to a single grid row
+*/
+void plan_bands(const feature_engine &engine, int blocks_width, int blocks_height, size_t budget, int &band_height, int &parallel) {
+	int threads = get_num_threads();
+	band_height = max(1, min(128, blocks_height));
+	parallel = threads;
+	if(budget == 0) return;
+
+	auto band_bytes = [&](int rows) {
+		return engine.workspace(rows) + 2 * (size_t)rows * blocks_width * (engine.length + sizeof(int));
+	};
+	while(band_height > 16 && band_bytes(band_height) * threads > budget) {
+		band_height /= 2;
+	}
+	parallel = (int)max((size_t)1, min((size_t)threads, budget / band_bytes(band_height)));
+	while(band_height > 1 && band_bytes(band_height) > budget) {
+		band_height /= 2;
+	}
+}
+
+/*
+	Extract the block grid in bands of band_height grid rows, "parallel" bands at
+	a time (see plan_bands), and append their keys and positions to features and
+	positions in grid order. after_band() runs after every appended band and may
+	empty both buffers, extraction stops when it returns false
+*/
+void extract_bands(const Mat &grayscale, int blocksize, int stride, const feature_engine &engine, const Mat &candidates, int band_height, int parallel, vector<uchar> &features, vector<int> &positions, const function<bool()> &after_band) {
+	int blocks_height = (grayscale.rows-blocksize) / stride + 1;
+	int bands = (blocks_height + band_height - 1) / band_height;
+	for(int group=0; group<bands; group+=parallel) {
+		int group_end = min(group + parallel, bands);
+		vector< vector<uchar> > band_features(group_end - group);
+		vector< vector<int> > band_positions(group_end - group);
+		parallel_chunks(group, group_end, [&](int begin, int end, int) {
+			for(int band=begin; band<end; band++) {
+				int y = band * band_height;
+				int y_end = min(y + band_height, blocks_height);
+				extract_band(grayscale, blocksize, stride, engine, candidates, y, y_end, band_features[band - group], band_positions[band - group]);
+			}
+		});
+
+		for(int band=0; band<group_end - group; band++) {
+			features.insert(features.end(), band_features[band].begin(), band_features[band].end());
+			positions.insert(positions.end(), band_positions[band].begin(), band_positions[band].end());
+			vector<uchar>().swap(band_features[band]);
+			vector<int>().swap(band_positions[band]);
+			if(!after_band()) return;
+		}
+	}
+}
+
+/*
+	Sequential reader over one sorted run of the external copy-move sort. Records
+	are the key followed by the block grid index
+*/
+class run_reader {
+	private:
+		FILE *file;
+		size_t record_size, records, left;
+		vector<uchar> buffer;
+		size_t pos, filled;
+
+	public:
+		run_reader(FILE *f, size_t size, size_t count, size_t buffer_records)
+			: file(f), record_size(size), records(count), left(count), buffer(size * buffer_records), pos(0), filled(0) {}
+
+		//back to the start, next() loads the first record
+		void restart() {
+			rewind(file);
+			left = records;
+			pos = filled = 0;
+		}
+
+		bool next() {
+			pos += record_size;
+			if(pos >= filled) {
+				size_t count = min(left, buffer.size() / record_size);
+				if(count == 0) return false;
+				if(fread(&buffer[0], record_size, count, file) != count) return false;
+				left -= count;
+				filled = count * record_size;
+				pos = 0;
+			}
+			return true;
+		}
+
+		const uchar *current() const {
+			return &buffer[pos];
+		}
+};
+
+/*
+	Out-of-core version of the block matcher, for when the keys do not fit in
+	memlimit bytes. Half of memlimit holds a run of keys, the other half the bands
+	being extracted (see plan_bands). Runs are sorted in memory and written to
+	temporary files, then merged with a streaming k-way merge.
+	Runs hold consecutive bands and ties go to the earlier run, so the merged
+	order is the same as the in-memory stable sort.
+
+	The first merge counts the shift votes. The second one only keeps the pairs
+	with more than min_votes votes, so the recorded matches stay small too.
+	Returns false if the temporary files cannot be created
+*/
+bool match_blocks_external(const Mat &grayscale, int blocksize, int stride, const feature_engine &engine, const Mat &candidates, size_t memlimit, int min_votes, vector<block_match> &matches, shift_histogram &s_count) {
+	int length = engine.length;
+	size_t record_size = length + sizeof(int);
+	int blocks_height = (grayscale.rows-blocksize) / stride + 1;
+	int blocks_width = (grayscale.cols-blocksize) / stride + 1;
+
+	//keys, positions and both radix index buffers of a run in half the budget
+	size_t run_capacity = max((size_t)1, memlimit / 2 / (length + 3*sizeof(int)));
+
+	vector<FILE*> runs;
+	vector<size_t> run_records;
+	vector<uchar> features;
+	vector<int> positions;
+	bool failed = false;
+
+	//sort the current run and write it out
+	auto flush_run = [&]() {
+		int n = positions.size();
+		if(n == 0 || failed) return;
+
+		vector<int> index(n);
+		for(int i=0; i<n; i++)
+			index[i] = i;
+		radix_sort_keys(&features[0], length, index);
+
+		FILE *run = tmpfile();
+		if(!run) {
+			failed = true;
+			return;
+		}
+
+		vector<uchar> out(record_size * 4096);
+		size_t filled = 0;
+		for(int i=0; i<n; i++) {
+			memcpy(&out[filled], &features[(size_t)index[i] * length], length);
+			memcpy(&out[filled + length], &positions[index[i]], sizeof(int));
+			filled += record_size;
+			if(filled == out.size() || i == n-1) {
+				if(fwrite(&out[0], 1, filled, run) != filled) failed = true;
+				filled = 0;
+			}
+		}
+
+		runs.push_back(run);
+		run_records.push_back(n);
+		features.clear();
+		positions.clear();
+	};
+
+	//extract the bands the other half of the budget allows at a time, flush
+	//whenever a run is full
+	int band_height, parallel;
+	plan_bands(engine, blocks_width, blocks_height, memlimit / 2, band_height, parallel);
+	extract_bands(grayscale, blocksize, stride, engine, candidates, band_height, parallel, features, positions, [&]() {
+		if(positions.size() >= run_capacity) {
+			flush_run();
+		}
+		return !failed;
+	});
+	flush_run();
+	vector<uchar>().swap(features);
+	vector<int>().swap(positions);
+
+	if(failed) {
+		for(size_t r=0; r<runs.size(); r++) {
+			fclose(runs[r]);
+		}
+		return false;
+	}
+
+	//the other half of the budget goes to the read buffers
+	size_t buffer_records = max((size_t)64, memlimit / 2 / max(runs.size(), (size_t)1) / record_size);
+	vector<run_reader> readers;
+	for(size_t r=0; r<runs.size(); r++) {
+		readers.push_back(run_reader(runs[r], record_size, run_records[r], buffer_records));
+	}
+
+	//min-heap of runs by their current key, ties to the earlier run
+	auto later = [&](int a, int b) {
+		int order = memcmp(readers[a].current(), readers[b].current(), length);
+		return order > 0 || (order == 0 && a > b);
+	};
+
+	//stream the runs in sorted order, calling pair() for neighbours with equal keys
+	auto merge = [&](const function<void(int, int)> &pair) {
+		priority_queue<int, vector<int>, function<bool(int, int)> > heap(later);
+		for(size_t r=0; r<readers.size(); r++) {
+			readers[r].restart();
+			if(readers[r].next()) heap.push(r);
+		}
+
+		vector<uchar> previous(record_size);
+		bool first = true;
+		while(!heap.empty()) {
+			int r = heap.top();
+			heap.pop();
+
+			const uchar *record = readers[r].current();
+			if(!first && memcmp(&previous[0], record, length) == 0) {
+				int a, b;
+				memcpy(&a, &previous[length], sizeof(int));
+				memcpy(&b, record + length, sizeof(int));
+				pair(a, b);
+			}
+			memcpy(&previous[0], record, record_size);
+			first = false;
+
+			if(readers[r].next()) heap.push(r);
+		}
+	};
+
+	merge([&](int a, int b) {
+		Point shift = grid_shift(a, b, blocks_width);
+		if ( norm(shift) * stride > blocksize ) {
+			s_count.add(shift.x, shift.y);
+		}
+	});
+
+	merge([&](int a, int b) {
+		Point shift = grid_shift(a, b, blocks_width);
+		if ( norm(shift) * stride > blocksize && s_count.count(shift.x, shift.y) > min_votes ) {
+			block_match match = {a, b};
+			matches.push_back(match);
+		}
+	});
+
+	for(size_t r=0; r<runs.size(); r++) {
+		fclose(runs[r]);
+	}
+	return true;
+}
+
+/*
+	Block matcher for Copy-Move detection. Extracts the engine's features of every
+	blocksize x blocksize block on a grid with "stride" pixels between blocks,
+	sorts them and collects the pairs of identical blocks that are further apart
+	than the block size, along with the votes for their shift vectors (in grid
+	units).
+
+	If candidates is not empty (a CV_8U mask the size of the block grid), only
+	the block positions where it is non-zero are used. Matches are returned as
+	indices into the block grid, in sorted order.
+
+	If memlimit is set and the keys would not fit, the external sort above is used
+	and only the matches with more than min_votes votes are returned
+*/
+void match_blocks(const Mat &grayscale, int blocksize, int stride, const feature_engine &engine, const Mat &candidates, size_t memlimit, int min_votes, vector<block_match> &matches, shift_histogram &s_count) {
+	int subm_limit = engine.length;
+	if(subm_limit < 1) return;
+
+	if(grayscale.rows < blocksize || grayscale.cols < blocksize) return;
+	int blocks_height = (grayscale.rows-blocksize) / stride + 1;
+	int blocks_width = (grayscale.cols-blocksize) / stride + 1;
+
+	//keys, index and radix buffer, plus the positions with a candidate mask
+	size_t blocks = candidates.empty() ? (size_t)blocks_height * blocks_width : countNonZero(candidates);
+	size_t needed = blocks * (subm_limit + 2*sizeof(int) + (candidates.empty() ? 0 : sizeof(int)));
+	if(memlimit > 0 && needed > memlimit) {
+		if(match_blocks_external(grayscale, blocksize, stride, engine, candidates, memlimit, min_votes, matches, s_count)) {
+			return;
+		}
+		cerr << "Warning: Cannot create temporary files, copy-move falls back to memory." << endl;
+	}
+
+	//keys of the blocks, subm_limit bytes per block
+	vector<uchar> features;
+	//block grid index of every feature, left empty when all blocks are used
+	vector<int> positions;
+
+	//extract features in bands of rows to bound the size of the engine buffers,
+	//as many bands at once as what the keys leave of memlimit allows
+	int band_height, parallel;
+	plan_bands(engine, blocks_width, blocks_height, memlimit == 0 ? 0 : max(memlimit, needed + 1) - needed, band_height, parallel);
+	int bands = (blocks_height + band_height - 1) / band_height;
+	if(candidates.empty()) {
+		features.resize((size_t)blocks_height * blocks_width * subm_limit);
+		for(int group=0; group<bands; group+=parallel) {
+			parallel_chunks(group, min(group + parallel, bands), [&](int begin, int end, int) {
+				for(int band=begin; band<end; band++) {
+					int y = band * band_height;
+					int y_end = min(y + band_height, blocks_height);
+					engine.extract(grayscale, y, y_end, &features[0] + (size_t)y * blocks_width * subm_limit);
+				}
+			});
+		}
+	} else {
+		extract_bands(grayscale, blocksize, stride, engine, candidates, band_height, parallel, features, positions, []() {
+			return true;
+		});
+		if(positions.size() < 2) return;
+	}
+
+	int total_blocks = features.size() / subm_limit;
+
+	vector<int> index(total_blocks);
+	for(int i=0; i<total_blocks; i++)
+		index[i] = i;
+
+	radix_sort_keys(&features[0], subm_limit, index);
+
+	//count shift vectors and record the matching pairs in a single pass, every
+	//thread keeps its own tally and pairs for its slice of the sorted index
+	int threads = get_num_threads();
+	vector<shift_histogram> tallies(threads);
+	vector< vector<block_match> > thread_matches(threads);
+	parallel_chunks(0, total_blocks-1, [&](int begin, int end, int t) {
+		for(int i=begin; i<end; i++) {
+			const uchar *v_a = &features[(size_t)index[i] * subm_limit];
+			const uchar *v_b = &features[(size_t)index[i+1] * subm_limit];
+
+			if(equal(v_a, v_a+subm_limit, v_b)) {
+				int a = positions.empty() ? index[i] : positions[index[i]];
+				int b = positions.empty() ? index[i+1] : positions[index[i+1]];
+
+				Point shift = grid_shift(a, b, blocks_width);
+				if ( norm(shift) * stride > blocksize ) {
+					tallies[t].add(shift.x, shift.y);
+					block_match match = {a, b};
+					thread_matches[t].push_back(match);
+				}
+			}
+		}
+	});
+
+	for(int t=0; t<threads; t++) {
+		s_count.merge(tallies[t]);
+		matches.insert(matches.end(), thread_matches[t].begin(), thread_matches[t].end());
+	}
+}
+
+/*
+	Block based Copy-Move detection, shared by the DCT and PCA engines
 
 	implementation adapted from "Detection of Copy-Move Forgery in Digital Images"
 	by Jessica Fridrich, David Soukal, Jan Lukas
@@ -580,107 +2142,244 @@ template<class T> class sorter {
 	https://sites.google.com/site/elsamuko/forensics/clone-detection
 
 	This function is different from the above resources:
-	- Instead of quantizing by the modified JPEG table, this will instead compare
-		the square submatrix of the DCT values, where the submatrix length is the
-		"retain" parameter
+	- Instead of quantizing by the modified JPEG table, the DCT engine will instead
+		compare the square submatrix of the DCT values, where the submatrix length
+		is the "retain" parameter. The PCA engine compares 2*retain principal
+		component projections
 	- The matches with the same shift-vector magnitude get painted in the same (random) color
+	- Blocks can be taken every "stride" pixels instead of at every pixel, the
+		vote threshold is lowered to match (see copy_move_votes)
+	- With pyramid > 0, the matcher first runs on the image downscaled by
+		2^pyramid (blocks and quantization scaled to match). Only the areas around
+		the blocks matched there with enough votes are checked at full resolution.
+		This trades a little recall for speed on big images
+	- With a memlimit, keys that do not fit are sorted on disk
+		(see match_blocks_external)
 */
-void copy_move_dct(Mat &src, Mat &dst, int retain = 4, double qcoeff = 1.0) {
-	Mat grayscale;
-	cvtColor( src, grayscale, CV_BGR2GRAY );
-	grayscale.convertTo(grayscale, CV_32F);
+void copy_move_blocks(image_cache &cache, Mat &dst, const copy_move_params &params, copy_move_engine engine) {
+	const Mat &src = cache.source();
+	const Mat &grayscale = cache.grayscale();
 
 	Mat rectBuffer = src.clone();
 
-	int subm_limit = retain * retain;
+	int blocksize = max(params.blocksize, 2);
+	int stride = max(params.stride, 1);
+	int retain = min(max(params.retain, 1), blocksize);
+	double qcoeff = params.qcoeff;
+	int pyramid = max(params.pyramid, 0);
 
-	int blocksize = 16;
-	int blocks_height = src.rows-blocksize+1;
-	int blocks_width = src.cols-blocksize+1;
-	int total_blocks = blocks_height * blocks_width;
+	int blocks_height = src.rows < blocksize ? 0 : (src.rows-blocksize) / stride + 1;
+	int blocks_width = src.cols < blocksize ? 0 : (src.cols-blocksize) / stride + 1;
 
-	vector< Mat > blocks;
-	blocks.reserve(total_blocks);
+	//coarse blocks must still hold the retained coefficients
+	while(pyramid > 0 && (blocksize >> pyramid) < max(retain, 4)) {
+		pyramid--;
+	}
 
-	Mat tmp;
+	Mat candidates;
+	bool search = blocks_height > 0 && blocks_width > 0;
+	if(search && pyramid > 0) {
+		int scale = 1 << pyramid;
+		int coarse_blocksize = blocksize / scale;
 
-	for(int y=0; y<blocks_height; y++) {
-		for(int x=0; x<blocks_width; x++) {
-			dct(grayscale(Rect(x,y,blocksize,blocksize)), tmp);
-			tmp = tmp / qcoeff;
-			tmp.convertTo(tmp, CV_8U);
-			blocks.push_back(tmp(Rect(0,0,retain,retain)).clone());
+		Mat coarse = grayscale;
+		for(int l=0; l<pyramid; l++) {
+			pyrDown(coarse, coarse);
 		}
-	}
 
-	int *index = new int[total_blocks];
-	for(int i=0; i<total_blocks; i++)
-		index[i] = i;
-
-	int *s_count = new int[src.rows * src.cols * 2];
-	for (int i=0; i<src.rows * src.cols * 2; i++ )
-		s_count[i] = 0;
+		//projections shrink with the block, quantize them just as coarsely
+		vector<block_match> coarse_matches;
+		shift_histogram coarse_count;
+		feature_engine coarse_engine = make_feature_engine(engine, coarse, coarse_blocksize, 1, retain, qcoeff / scale);
+		//a clone covers scale^2 fewer block positions down there
+		int coarse_votes = copy_move_votes(scale);
+		match_blocks(coarse, coarse_blocksize, 1, coarse_engine, Mat(), params.memlimit, coarse_votes, coarse_matches, coarse_count);
+
+		//full resolution blocks within one coarse pixel of a matched coarse block
+		candidates = Mat::zeros(blocks_height, blocks_width, CV_8U);
+		Rect grid(0, 0, blocks_width, blocks_height);
+		int coarse_width = coarse.cols - coarse_blocksize + 1;
+		for(size_t i=0; i<coarse_matches.size(); i++) {
+			Point shift = grid_shift(coarse_matches[i].a, coarse_matches[i].b, coarse_width);
+
+			if( coarse_count.count(shift.x, shift.y) > coarse_votes ) {
+				Point corners[] = {
+					Point(coarse_matches[i].a % coarse_width, coarse_matches[i].a / coarse_width),
+					Point(coarse_matches[i].b % coarse_width, coarse_matches[i].b / coarse_width)
+				};
+				for(int c=0; c<2; c++) {
+					//full resolution pixels around the coarse block, on the block grid
+					int x0 = max(corners[c].x*scale - scale, 0), y0 = max(corners[c].y*scale - scale, 0);
+					int x1 = corners[c].x*scale + scale, y1 = corners[c].y*scale + scale;
+					Point tl((x0 + stride - 1) / stride, (y0 + stride - 1) / stride);
+					Point br(x1 / stride + 1, y1 / stride + 1);
+					candidates(Rect(tl, br) & grid) = Scalar(255);
+				}
+			}
+		}
 
-	sort(index, index+total_blocks, sorter<Mat>(blocks));
+		search = countNonZero(candidates) > 1;
+	}
 
-	for(int i=0; i<total_blocks-1; i++) {
-		unsigned char *v_a = (unsigned char*)(blocks[index[i]].data);
-		unsigned char *v_b = (unsigned char*)(blocks[index[i+1]].data);
+	int votes = copy_move_votes(stride);
 
-		if(equal(v_a, v_a+subm_limit, v_b)) {
-			Point cur, next, shift;
-			cur.x = index[i] % blocks_width;
-			cur.y = (index[i] - cur.x) / (float)blocks_width;
+	vector<block_match> matches;
+	shift_histogram s_count;
+	if(search) {
+		match_blocks(grayscale, blocksize, stride, make_feature_engine(engine, grayscale, blocksize, stride, retain, qcoeff), candidates, params.memlimit, votes, matches, s_count);
+	}
 
-			next.x = index[i+1] % blocks_width;
-			next.y = (index[i+1] - next.x) / (float)blocks_width;
+	//paint in sorted index order, the later pair wins where blocks overlap
+	for(size_t i=0; i<matches.size(); i++) {
+		Point shift = grid_shift(matches[i].a, matches[i].b, blocks_width);
 
-			shift = cur - next;
-			if(shift.x < 0) shift *= -1;
+		if( s_count.count(shift.x, shift.y) > votes ) {
+			//block grid to pixels
+			Point cur(matches[i].a % blocks_width * stride, matches[i].a / blocks_width * stride);
+			Point next(matches[i].b % blocks_width * stride, matches[i].b / blocks_width * stride);
 
-			double magnitude = norm(shift);
+			double magnitude = norm(shift) * stride;
 
-			shift.y += src.rows;
+			RNG rng((int)magnitude);
+			Vec3b color = Vec3b(rng.uniform(0,255), rng.uniform(0, 255), rng.uniform(0, 255));
 
-			if ( magnitude > blocksize ) {
-				int s_indx = shift.y * (src.cols) + shift.x;
-				s_count[s_indx]++;
+			for(int ii=0; ii<blocksize; ii++) {
+				for(int jj=0; jj<blocksize; jj++) {
+						rectBuffer.at<Vec3b>(cur.y+ii, cur.x+jj) = color;
+						rectBuffer.at<Vec3b>(next.y+ii, next.x+jj) = color;
+				}
 			}
 		}
 	}
 
-	for(int i=0; i<total_blocks-1; i++) {
-		unsigned char *v_a = (unsigned char*)(blocks[index[i]].data);
-		unsigned char *v_b = (unsigned char*)(blocks[index[i+1]].data);
+	addWeighted(src, 0.2, rectBuffer, 0.8, 0, dst);
+}
 
-		if(equal(v_a, v_a+subm_limit, v_b)) {
-			Point cur, next, shift;
-			cur.x = index[i] % blocks_width;
-			cur.y = (index[i] - cur.x) / (float)blocks_width;
+/*
+	Copy-Move detection using DCT, see copy_move_blocks
+*/
+void copy_move_dct(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	copy_move_blocks(cache, dst, params, CM_DCT);
+}
 
-			next.x = index[i+1] % blocks_width;
-			next.y = (index[i+1] - next.x) / (float)blocks_width;
+void copy_move_dct(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	image_cache cache(src);
+	copy_move_blocks(cache, dst, params, CM_DCT);
+}
 
-			shift = cur - next;
-			if(shift.x < 0) shift *= -1;
+/*
+	Copy-Move detection using PCA reduced blocks, see copy_move_blocks
+*/
+void copy_move_pca(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	copy_move_blocks(cache, dst, params, CM_PCA);
+}
 
-			double magnitude = norm(shift);
+void copy_move_pca(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	image_cache cache(src);
+	copy_move_blocks(cache, dst, params, CM_PCA);
+}
 
-			shift.y += src.rows;
+/*
+	Copy-Move detection using ORB keypoints. The work grows with the number of
+	keypoints instead of the number of pixels, so this stays usable on very large
+	images where the block engines are not.
+
+	Keypoint descriptors are matched against themselves through an LSH index. A
+	match is kept if it passes the ratio test against the next nearest neighbor
+	and the keypoints are further apart than the block size. Matches are then
+	clustered by their shift vector (in bins of half a block, neighbouring bins
+	included) and clusters of at least 4 matches are painted like the block
+	engines do, a blocksize x blocksize square on both keypoints
+*/
+void copy_move_orb(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	const Mat &src = cache.source();
+	const Mat &grayscale = cache.grayscale();
 
-			RNG rng((int)magnitude);
-			Vec3b color = Vec3b(rng.uniform(0,255), rng.uniform(0, 255), rng.uniform(0, 255));
+	Mat rectBuffer = src.clone();
 
-			if( s_count[shift.y*src.cols+shift.x] > 10 ) {
-				for(int ii=0; ii<blocksize; ii++) {
-					for(int jj=0; jj<blocksize; jj++) {
-							rectBuffer.at<Vec3b>(cur.y+ii, cur.x+jj) = color;
-							rectBuffer.at<Vec3b>(next.y+ii, next.x+jj) = color;
-					}
+	int blocksize = max(params.blocksize, 2);
+	int bin = max(blocksize / 2, 1);
+
+	//about one keypoint per 2x2 blocks of image
+	int features = max(1000, (int)((double)src.rows * src.cols / (4 * blocksize * blocksize)));
+
+	vector<KeyPoint> keypoints;
+	Mat descriptors;
+	ORB orb(features);
+	orb(grayscale, Mat(), keypoints, descriptors);
+
+	vector<block_match> matches;
+	shift_histogram s_count;
+	if(keypoints.size() > 2) {
+		FlannBasedMatcher matcher(new flann::LshIndexParams(12, 20, 2));
+		vector< vector<DMatch> > neighbors;
+		matcher.knnMatch(descriptors, descriptors, neighbors, 3);
+
+		//nearest neighbor other than the keypoint itself, if it passes the ratio test
+		vector<int> nearest(keypoints.size(), -1);
+		for(size_t i=0; i<neighbors.size(); i++) {
+			const DMatch *first = NULL, *second = NULL;
+			for(size_t k=0; k<neighbors[i].size(); k++) {
+				if(neighbors[i][k].trainIdx == (int)i) continue;
+				if(!first) {
+					first = &neighbors[i][k];
+				} else if(!second) {
+					second = &neighbors[i][k];
 				}
 			}
+			if(first && (!second || first->distance < 0.6 * second->distance)) {
+				nearest[i] = first->trainIdx;
+			}
+		}
+
+		for(int i=0; i<(int)nearest.size(); i++) {
+			int j = nearest[i];
+			if(j < 0 || (j < i && nearest[j] == i)) continue; //mutual pairs only once
+
+			Point2f cur = keypoints[i].pt, next = keypoints[j].pt;
+			Point shift(cvRound(cur.x - next.x), cvRound(cur.y - next.y));
+			if(shift.x < 0 || (shift.x == 0 && shift.y < 0)) shift *= -1;
+
+			if(norm(shift) > blocksize) {
+				s_count.add(cvFloor((double)shift.x / bin), cvFloor((double)shift.y / bin));
+				block_match match = {i, j};
+				matches.push_back(match);
+			}
+		}
+	}
+
+	Rect image(0, 0, src.cols, src.rows);
+	for(size_t i=0; i<matches.size(); i++) {
+		Point2f cur = keypoints[matches[i].a].pt, next = keypoints[matches[i].b].pt;
+		Point shift(cvRound(cur.x - next.x), cvRound(cur.y - next.y));
+		if(shift.x < 0 || (shift.x == 0 && shift.y < 0)) shift *= -1;
+
+		//votes of the shift bin and its neighbours
+		int bx = cvFloor((double)shift.x / bin), by = cvFloor((double)shift.y / bin);
+		int votes = 0;
+		for(int dy=-1; dy<=1; dy++) {
+			for(int dx=-1; dx<=1; dx++) {
+				votes += s_count.count(bx + dx, by + dy);
+			}
+		}
+		if(votes < 4) continue;
+
+		double magnitude = norm(shift);
+
+		RNG rng((int)magnitude);
+		Vec3b color = Vec3b(rng.uniform(0,255), rng.uniform(0, 255), rng.uniform(0, 255));
+
+		Point2f corners[] = {cur, next};
+		for(int c=0; c<2; c++) {
+			Rect block(cvRound(corners[c].x) - blocksize/2, cvRound(corners[c].y) - blocksize/2, blocksize, blocksize);
+			rectBuffer(block & image) = Scalar(color[0], color[1], color[2]);
 		}
 	}
 
 	addWeighted(src, 0.2, rectBuffer, 0.8, 0, dst);
+}
+
+void copy_move_orb(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params()) {
+	image_cache cache(src);
+	copy_move_orb(cache, dst, params);
 }
\ No newline at end of file
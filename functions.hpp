@@ -1,13 +1,46 @@
 #ifndef FUNCTIONS_HPP
 #define FUNCTIONS_HPP
 
+#include <functional>
 #include <opencv2/core/core.hpp>
 
 #include "structs.h"
+#include "jpeg.hpp"
 
 using namespace cv;
 using namespace std;
 
+/*
+	Number of worker threads used by the analyses. 0 (the default) means one
+	thread per CPU core
+*/
+void set_num_threads(int threads);
+int get_num_threads();
+
+/*
+	Process-wide pool of get_num_threads() threads shared by everything running
+	analyses, the main thread starts as its member. A thread that runs analyses
+	next to others joins with acquire_worker (waiting for a free place) and
+	leaves with release_worker. available_threads() is the calling thread plus
+	the free places, what a parallel call could use right now
+*/
+void acquire_worker();
+void release_worker();
+int available_threads();
+
+/*
+	Split [begin, end) into at most get_num_threads() contiguous chunks and run
+	body(chunk_begin, chunk_end, chunk_index) for each, on the calling thread and
+	the free threads of the pool
+*/
+void parallel_chunks(int begin, int end, const function<void(int, int, int)> &body);
+
+/*
+	Every analysis below also takes an image_cache (see structs.h) in place of
+	the source image, so analyses run on the same image share its grayscale
+	image and its unique colour table
+*/
+
 /*
 	Return all colors which have at least one component (R,G,B) set to 255
 */
@@ -25,36 +58,79 @@ void hsv_histogram_stretch(Mat &src, Mat &dst);
 	HSV Colorspace Histogram for the image. Count all occurrences of (H,S) and sum the V component, representing the average V in HSV colorspace for each color.
 */
 void hsv_histogram(Mat &src, Mat &dst, bool whitebg = false);
+void hsv_histogram(image_cache &cache, Mat &dst, bool whitebg = false);
+
+/*
+	HLS Colorspace Histogram for the image. Count all occurrences of (H,S) and sum the L component, representing the average L in HLS colorspace for each color.
+*/
+void hls_histogram(Mat &src, Mat &dst, bool whitebg = false);
+void hls_histogram(image_cache &cache, Mat &dst, bool whitebg = false);
 
 /*
 	Lab Colorspace Histogram for the image. Count all occurrences of (a,b) and sum the L component, representing the average L in Lab colorspace for each color.
 */
 void lab_histogram(Mat &src, Mat &dst, bool whitebg = false);
+void lab_histogram(image_cache &cache, Mat &dst, bool whitebg = false);
 void lab_histogram_fast(Mat &src, Mat &dst, bool whitebg = false);
+void lab_histogram_fast(image_cache &cache, Mat &dst, bool whitebg = false);
+
+/*
+	YCbCr Colorspace Histogram for the image. Count all occurrences of (Cb,Cr) and sum the Y component, representing the average Y in the JPEG YCbCr colorspace for each color.
+*/
+void ycbcr_histogram(Mat &src, Mat &dst, bool whitebg = false);
+void ycbcr_histogram(image_cache &cache, Mat &dst, bool whitebg = false);
 
 /*
 	Apply Error Level Analysis to the image. Resave source image at a known quality and subtract the known quality from the source image.
 */
 void error_level_analysis(Mat &src, Mat &dst, int quality = 90);
 
+/*
+	Error Level Analysis at several qualities in one go, the resaves are encoded in
+	parallel. dst and stats get one entry per quality, stats describe the absolute
+	differences before they are normalized for viewing. ELA_DCT simulates the
+	resave per 8x8 block in the coefficient domain instead of running the codec
+*/
+void error_level_analysis(Mat &src, vector<Mat> &dst, const vector<int> &qualities, vector<ela_stats> &stats, ela_engine engine = ELA_JPEG);
+
 /*
 	Colorized X and Y Sobel filters.
 */
 void luminance_gradient(Mat &src, Mat &dst);
+void luminance_gradient(image_cache &cache, Mat &dst);
 
 /*
 	Turn every pixel value to the average of the magnitude of its cross-shaped neighbors.
 */
 void average_distance(Mat &src, Mat &dst);
+void average_distance(image_cache &cache, Mat &dst);
 
 /*
 	Estimate JPEG quality using Hackerfactor and Imagemagick estimates
 */
+int estimate_jpeg_quality(const jpeg_index &index, vector<qtable> &qtables, vector<double> &quality_estimates);
 int estimate_jpeg_quality(const char *filename, vector<qtable> &qtables, vector<double> &quality_estimates);
 
 /*
-	Copy-Move detection using DCT
+	Copy-Move detection using DCT. See copy_move_params for the knobs, a pyramid
+	pre-screens on an image downscaled 2^pyramid times and only verifies the
+	candidate areas at full resolution
+*/
+void copy_move_dct(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params());
+void copy_move_dct(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params());
+
+/*
+	Copy-Move detection comparing blocks projected onto their first 2*retain
+	principal components (Popescu & Farid), same knobs as copy_move_dct
+*/
+void copy_move_pca(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params());
+void copy_move_pca(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params());
+
+/*
+	Copy-Move detection by self-matching ORB keypoints and clustering the matches
+	by shift vector. Only blocksize (the painted square) is used from params
 */
-void copy_move_dct(Mat &src, Mat &dst, int retain = 4, double qcoeff = 1.0);
+void copy_move_orb(Mat &src, Mat &dst, const copy_move_params &params = copy_move_params());
+void copy_move_orb(image_cache &cache, Mat &dst, const copy_move_params &params = copy_move_params());
 
 #endif
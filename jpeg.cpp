@@ -0,0 +1,450 @@
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <csetjmp>
+#include <thread>
+#include <atomic>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+extern "C" {
+#include <jpeglib.h>
+}
+
+#include "jpeg.hpp"
+#include "functions.hpp"
+
+using namespace std;
+using namespace cv;
+
+jpeg_index::jpeg_index() : bytes(NULL), size(0), state(-2) {}
+
+jpeg_index::jpeg_index(const unsigned char *bytes, size_t size, bool headers_only) : bytes(NULL), size(0), state(-2) {
+	parse(bytes, size, headers_only);
+}
+
+/*
+	Walk the marker segments from SOI. Each segment is recorded with its offset
+	and a view of its payload. After SOS the entropy-coded data is skipped up to
+	the next marker that is neither a stuffed 0xFF00 nor a restart marker
+*/
+int jpeg_index::parse(const unsigned char *bytes, size_t size, bool headers_only) {
+	this->bytes = bytes;
+	this->size = size;
+	list.clear();
+
+	// first two bytes must be 0xffd8 for jpeg format
+	if(size < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+		return state = -2;
+	}
+
+	size_t pos = 2;
+	while(pos < size) {
+		if(bytes[pos] != 0xFF) { //something wrong with this jpeg
+			return state = -1;
+		}
+		//markers may be padded with any number of 0xFF fill bytes
+		while(pos + 1 < size && bytes[pos+1] == 0xFF) {
+			pos++;
+		}
+		if(pos + 1 >= size) {
+			break;
+		}
+
+		unsigned char marker = bytes[pos+1];
+		size_t offset = pos;
+		pos += 2;
+
+		//standalone markers carry no length
+		if(marker == 0xD9 || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			jpeg_segment segment = {marker, offset, bytes + pos, 0};
+			list.push_back(segment);
+			if(marker == 0xD9) { //end of image
+				break;
+			}
+			continue;
+		}
+
+		//next two bytes are the size of the segment, including themselves
+		if(pos + 2 > size) {
+			return state = -1;
+		}
+		size_t length = (bytes[pos] << 8) | bytes[pos+1];
+		if(length < 2 || pos + length > size) {
+			return state = -1;
+		}
+
+		jpeg_segment segment = {marker, offset, bytes + pos + 2, length - 2};
+		list.push_back(segment);
+		pos += length;
+
+		//start of scan, entropy-coded data until the next real marker
+		if(marker == 0xDA && headers_only) {
+			break;
+		}
+		if(marker == 0xDA) {
+			while(true) {
+				const unsigned char *next = (const unsigned char*)memchr(bytes + pos, 0xFF, size - pos);
+				if(next == NULL || next + 1 >= bytes + size) { //truncated scan
+					pos = size;
+					break;
+				}
+				pos = next - bytes;
+				unsigned char following = bytes[pos+1];
+				if(following == 0x00 || (following >= 0xD0 && following <= 0xD7)) {
+					pos += 2;
+				} else if(following == 0xFF) {
+					pos++;
+				} else {
+					break;
+				}
+			}
+		}
+	}
+
+	return state = 1;
+}
+
+int jpeg_index::status() const {
+	return state;
+}
+
+const unsigned char *jpeg_index::data() const {
+	return bytes;
+}
+
+size_t jpeg_index::data_size() const {
+	return size;
+}
+
+const vector<jpeg_segment> &jpeg_index::segments() const {
+	return list;
+}
+
+vector<const jpeg_segment*> jpeg_index::find(unsigned char marker) const {
+	vector<const jpeg_segment*> found;
+	for(size_t i=0; i<list.size(); i++) {
+		if(list[i].marker == marker) {
+			found.push_back(&list[i]);
+		}
+	}
+	return found;
+}
+
+const jpeg_segment *jpeg_index::first(unsigned char marker) const {
+	for(size_t i=0; i<list.size(); i++) {
+		if(list[i].marker == marker) {
+			return &list[i];
+		}
+	}
+	return NULL;
+}
+
+bool jpeg_index::frame(jpeg_frame &info) const {
+	for(size_t i=0; i<list.size(); i++) {
+		unsigned char marker = list[i].marker;
+		//SOF0-SOF15 except DHT 0xC4, JPG 0xC8 and DAC 0xCC
+		if(marker < 0xC0 || marker > 0xCF || marker == 0xC4 || marker == 0xC8 || marker == 0xCC) {
+			continue;
+		}
+
+		const unsigned char *data = list[i].data;
+		if(list[i].length < 6) {
+			return false;
+		}
+		info.precision = data[0];
+		info.height = (data[1] << 8) | data[2];
+		info.width = (data[3] << 8) | data[4];
+		info.components = data[5];
+		info.progressive = marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE;
+		if(list[i].length < 6 + 3 * (size_t)info.components) {
+			return false;
+		}
+
+		//sampling factors, named when the chroma components are 1x1
+		int h[4] = {1, 1, 1, 1}, v[4] = {1, 1, 1, 1};
+		for(int c=0; c<info.components && c<4; c++) {
+			h[c] = data[7 + 3*c] >> 4;
+			v[c] = data[7 + 3*c] & 0x0F;
+		}
+
+		info.subsampling.clear();
+		if(info.components == 1) {
+			info.subsampling = "gray";
+		} else if(info.components == 3 && h[1] == 1 && v[1] == 1 && h[2] == 1 && v[2] == 1) {
+			if(h[0] == 1 && v[0] == 1) info.subsampling = "4:4:4";
+			else if(h[0] == 2 && v[0] == 1) info.subsampling = "4:2:2";
+			else if(h[0] == 2 && v[0] == 2) info.subsampling = "4:2:0";
+			else if(h[0] == 1 && v[0] == 2) info.subsampling = "4:4:0";
+			else if(h[0] == 4 && v[0] == 1) info.subsampling = "4:1:1";
+		}
+		if(info.subsampling.empty()) { //anything else as HxV per component
+			for(int c=0; c<info.components && c<4; c++) {
+				if(c > 0) info.subsampling += ",";
+				info.subsampling += to_string(h[c]) + "x" + to_string(v[c]);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+bool read_file(const string &filename, vector<unsigned char> &bytes, size_t limit) {
+	ifstream in(filename.c_str(), ios::binary);
+	if(!in) {
+		return false;
+	}
+
+	in.seekg(0, ios::end);
+	streamoff length = in.tellg();
+	if(length < 0) {
+		return false;
+	}
+	in.seekg(0, ios::beg);
+	if(limit > 0 && (size_t)length > limit) {
+		length = limit;
+	}
+
+	bytes.resize((size_t)length);
+	if(length > 0) {
+		in.read((char*)&bytes[0], length);
+	}
+	return (bool)in;
+}
+
+bool read_jpeg_headers(const string &filename, vector<unsigned char> &bytes) {
+	const size_t prefix = 64 * 1024;
+	if(!read_file(filename, bytes, prefix)) {
+		return false;
+	}
+	if(bytes.size() < prefix) { //that was the whole file
+		return true;
+	}
+
+	jpeg_index index(&bytes[0], bytes.size(), true);
+	if(index.status() == -1 || index.first(0xDA) == NULL) { //headers run past the prefix
+		return read_file(filename, bytes);
+	}
+	return true;
+}
+
+/*
+	Parallel decode of a baseline jpeg with restart intervals. The scan is cut at
+	the RSTn markers that fall on MCU row boundaries into one band per thread.
+	Every band becomes a small jpeg of its own: the original headers with the SOF
+	height patched to the band, the band's entropy-coded data with its RST
+	markers renumbered from RST0, and EOI. Each band is decoded with imdecode
+	together with a margin of rows on both sides, so chroma upsampling at the
+	band edges sees the same neighbours as a full decode and the result is
+	identical, and its own rows are copied into dst. Returns false, leaving dst alone, when the
+	file does not qualify (progressive, several scans, no DRI, intervals that
+	never line up with MCU rows, ...) or a band fails to decode
+*/
+bool decode_jpeg_restart(const jpeg_index &index, Mat &dst) {
+	const vector<jpeg_segment> &segments = index.segments();
+	const unsigned char *bytes = index.data();
+
+	const jpeg_segment *sof = NULL, *sos = NULL, *dri = NULL, *eoi = NULL;
+	int scans = 0;
+	for(size_t i=0; i<segments.size(); i++) {
+		unsigned char marker = segments[i].marker;
+		if(marker == 0xC0 || marker == 0xC1) { //baseline & extended huffman
+			sof = &segments[i];
+		} else if(marker > 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			return false; //progressive, lossless or arithmetic coded
+		} else if(marker == 0xDA) {
+			sos = &segments[i];
+			scans++;
+		} else if(marker == 0xDD && sos == NULL) {
+			dri = &segments[i];
+		} else if(marker == 0xD9) {
+			eoi = &segments[i];
+		}
+	}
+	if(index.status() < 1 || !sof || !sos || !dri || !eoi || scans != 1 || sof->length < 6 || dri->length < 2) {
+		return false;
+	}
+
+	int interval = (dri->data[0] << 8) | dri->data[1];
+	int height = (sof->data[1] << 8) | sof->data[2];
+	int width = (sof->data[3] << 8) | sof->data[4];
+	int components = sof->data[5];
+	if(interval == 0 || height == 0 || width == 0 || sof->data[0] != 8 || sof->length < 6 + 3 * (size_t)components) {
+		return false;
+	}
+	if(sos->length < 1 || sos->data[0] != components) { //one interleaved scan
+		return false;
+	}
+
+	//MCU size, a lone component is coded in 8x8 blocks whatever its sampling
+	int hmax = 1, vmax = 1;
+	if(components > 1) {
+		for(int c=0; c<components; c++) {
+			hmax = max(hmax, sof->data[7 + 3*c] >> 4);
+			vmax = max(vmax, sof->data[7 + 3*c] & 0x0F);
+		}
+	}
+	int mcu_width = 8 * hmax, mcu_height = 8 * vmax;
+	long long mcus_per_row = (width + mcu_width - 1) / mcu_width;
+	long long mcu_rows = (height + mcu_height - 1) / mcu_height;
+	long long intervals = (mcus_per_row * mcu_rows + interval - 1) / interval;
+
+	//bands can only start where an interval starts a row, every lcm MCUs
+	long long a = mcus_per_row, b = interval;
+	while(b) {
+		long long r = a % b;
+		a = b;
+		b = r;
+	}
+	long long unit_rows = interval / a; //lcm(mcus_per_row, interval) / mcus_per_row
+	long long units = (mcu_rows + unit_rows - 1) / unit_rows;
+	int bands = (int)min((long long)available_threads(), units);
+	if(bands < 2) {
+		return false;
+	}
+
+	//RST markers of the scan, one between every two intervals
+	size_t scan_begin = sos->data + sos->length - bytes, scan_end = eoi->offset;
+	vector<size_t> restarts;
+	for(size_t pos = scan_begin; pos + 1 < scan_end; ) {
+		const unsigned char *next = (const unsigned char*)memchr(bytes + pos, 0xFF, scan_end - pos - 1);
+		if(next == NULL) {
+			break;
+		}
+		pos = next - bytes;
+		if(bytes[pos+1] >= 0xD0 && bytes[pos+1] <= 0xD7) {
+			restarts.push_back(pos);
+			pos += 2;
+		} else {
+			pos += bytes[pos+1] == 0xFF ? 1 : 2;
+		}
+	}
+	if((long long)restarts.size() != intervals - 1) {
+		return false;
+	}
+
+	Mat image(height, width, CV_8UC3);
+	size_t sof_height = sof->data + 1 - bytes; //offset of the SOF height field
+	atomic<bool> failed(false);
+
+	//one chunk per band, on the free threads of the pool
+	parallel_chunks(0, bands, [&](int band_begin, int band_end, int) {
+		for(int t=band_begin; t<band_end; t++) {
+			long long row_begin = units * t / bands * unit_rows;
+			long long row_end = min(units * (t+1) / bands * unit_rows, mcu_rows);
+			int y0 = (int)(row_begin * mcu_height), y1 = (int)min(row_end * mcu_height, (long long)height);
+
+			//one more unit of rows on either side, chroma upsampling looks across the band edge
+			long long decode_begin = max(row_begin - unit_rows, 0LL);
+			long long decode_end = min(row_end + unit_rows, mcu_rows);
+			int decode_y0 = (int)(decode_begin * mcu_height);
+			int decode_y1 = (int)min(decode_end * mcu_height, (long long)height);
+
+			long long first = decode_begin * mcus_per_row / interval;
+			long long last = decode_end == mcu_rows ? intervals : decode_end * mcus_per_row / interval;
+			size_t begin = first == 0 ? scan_begin : restarts[first-1] + 2;
+			size_t end = last == intervals ? scan_end : restarts[last-1];
+
+			//headers, this band's scan and EOI
+			vector<unsigned char> band(bytes, bytes + scan_begin);
+			band[sof_height] = (unsigned char)((decode_y1 - decode_y0) >> 8);
+			band[sof_height+1] = (unsigned char)((decode_y1 - decode_y0) & 0xFF);
+			size_t scan = band.size();
+			band.insert(band.end(), bytes + begin, bytes + end);
+			for(long long i=first; i<last-1; i++) {
+				band[scan + restarts[i] - begin + 1] = (unsigned char)(0xD0 + (i - first) % 8);
+			}
+			band.push_back(0xFF);
+			band.push_back(0xD9);
+
+			Mat decoded = imdecode(band, CV_LOAD_IMAGE_COLOR);
+			if(decoded.rows != decode_y1 - decode_y0 || decoded.cols != width) {
+				failed = true;
+				continue;
+			}
+			decoded.rowRange(y0 - decode_y0, y1 - decode_y0).copyTo(image.rowRange(y0, y1));
+		}
+	});
+
+	if(failed) {
+		return false;
+	}
+	dst = image;
+	return true;
+}
+
+Mat decode_image(const vector<unsigned char> &bytes) {
+	if(bytes.empty()) {
+		return Mat();
+	}
+
+	//restart intervals only pay off on large images
+	jpeg_index index(&bytes[0], bytes.size());
+	jpeg_frame frame;
+	if(available_threads() > 1 && index.frame(frame) && (long long)frame.width * frame.height >= 4000000) {
+		Mat image;
+		if(decode_jpeg_restart(index, image)) {
+			return image;
+		}
+	}
+
+	return imdecode(bytes, CV_LOAD_IMAGE_COLOR);
+}
+
+//libjpeg error handler that jumps back to decode_jpeg_scaled instead of exiting
+struct jpeg_error_jump {
+	jpeg_error_mgr manager;
+	jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr info) {
+	longjmp(((jpeg_error_jump*)info->err)->jump, 1);
+}
+
+static void jpeg_silent_message(j_common_ptr info) {}
+
+bool decode_jpeg_scaled(const vector<unsigned char> &bytes, int denom, Mat &dst) {
+	if(bytes.size() < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+		return false;
+	}
+
+	jpeg_decompress_struct decoder;
+	jpeg_error_jump error;
+	decoder.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = jpeg_error_exit;
+	error.manager.output_message = jpeg_silent_message;
+	//only plain data from here on, a longjmp skips destructors
+	if(setjmp(error.jump)) {
+		jpeg_destroy_decompress(&decoder);
+		dst.release();
+		return false;
+	}
+
+	jpeg_create_decompress(&decoder);
+	jpeg_mem_src(&decoder, (unsigned char*)&bytes[0], bytes.size());
+	jpeg_read_header(&decoder, TRUE);
+
+	if(decoder.num_components != 1 && decoder.num_components != 3) { //CMYK & co.
+		jpeg_destroy_decompress(&decoder);
+		return false;
+	}
+	bool gray = decoder.num_components == 1;
+	decoder.out_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+
+	//DCT-domain downscaling, the decoder only computes the low frequencies
+	decoder.scale_num = 1;
+	decoder.scale_denom = denom;
+	jpeg_start_decompress(&decoder);
+
+	dst.create(decoder.output_height, decoder.output_width, gray ? CV_8UC1 : CV_8UC3);
+	while(decoder.output_scanline < decoder.output_height) {
+		JSAMPROW row = dst.ptr<uchar>(decoder.output_scanline);
+		jpeg_read_scanlines(&decoder, &row, 1);
+	}
+	jpeg_finish_decompress(&decoder);
+	jpeg_destroy_decompress(&decoder);
+
+	cvtColor(dst, dst, gray ? CV_GRAY2BGR : CV_RGB2BGR);
+	return true;
+}
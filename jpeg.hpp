@@ -0,0 +1,100 @@
+#ifndef JPEG_HPP
+#define JPEG_HPP
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+#include <opencv2/core/core.hpp>
+
+using namespace std;
+
+/*
+	One marker segment of a jpeg file. data points into the file bytes the
+	jpeg_index was built on, nothing is copied
+*/
+struct jpeg_segment {
+	unsigned char marker; //second marker byte, e.g. 0xDB DQT, 0xC0 SOF0, 0xC4 DHT, 0xDA SOS, 0xE0-0xEF APPn
+	size_t offset; //of the 0xFF marker byte in the file
+	const unsigned char *data; //payload, after the two length bytes
+	size_t length; //payload bytes
+};
+
+/*
+	Frame header (SOFn) summary
+*/
+struct jpeg_frame {
+	int width;
+	int height;
+	int components;
+	int precision; //bits per sample
+	bool progressive;
+	string subsampling; //"4:2:0", "4:2:2", "4:4:4", ..., "gray" or the raw HxV factors
+};
+
+/*
+	View-based index of all marker segments of a jpeg that is already in memory.
+	Entropy-coded data after each SOS is skipped, so progressive files with
+	several scans are indexed up to EOI. The bytes must outlive the index
+*/
+class jpeg_index {
+	private:
+		const unsigned char *bytes;
+		size_t size;
+		int state;
+		vector<jpeg_segment> list;
+
+	public:
+		jpeg_index();
+		jpeg_index(const unsigned char *bytes, size_t size, bool headers_only = false);
+
+		//index bytes[0, size), returns status(). headers_only stops at the first SOS
+		int parse(const unsigned char *bytes, size_t size, bool headers_only = false);
+		//1 indexed, -1 corrupt headers, -2 not a jpeg
+		int status() const;
+
+		const unsigned char *data() const;
+		size_t data_size() const;
+
+		const vector<jpeg_segment> &segments() const;
+		//segments with the given marker, in file order
+		vector<const jpeg_segment*> find(unsigned char marker) const;
+		//first segment with the given marker, NULL if there is none
+		const jpeg_segment *first(unsigned char marker) const;
+
+		//summary of the first SOFn segment, false if there is none
+		bool frame(jpeg_frame &info) const;
+};
+
+/*
+	Read a whole file into memory in one go, or its first limit bytes if limit is
+	not 0. false if it cannot be read
+*/
+bool read_file(const string &filename, vector<unsigned char> &bytes, size_t limit = 0);
+
+/*
+	Read just enough of a jpeg for its headers up to the first SOS: a 64 KB prefix,
+	or the whole file when the headers run past it
+*/
+bool read_jpeg_headers(const string &filename, vector<unsigned char> &bytes);
+
+/*
+	Decode a baseline jpeg that has restart intervals on several threads, one
+	band of MCU rows per thread. false if the file does not allow it, see jpeg.cpp
+*/
+bool decode_jpeg_restart(const jpeg_index &index, cv::Mat &dst);
+
+/*
+	Decode an image file held in memory to 8-bit BGR, like imdecode. Large jpegs
+	with restart intervals go through decode_jpeg_restart
+*/
+cv::Mat decode_image(const vector<unsigned char> &bytes);
+
+/*
+	Decode a jpeg held in memory at 1/denom of its size (denom 1, 2, 4 or 8) to
+	8-bit BGR using libjpeg's DCT-domain scaling, so the full resolution image is
+	never built. false if the bytes are not a grayscale or YCbCr jpeg
+*/
+bool decode_jpeg_scaled(const vector<unsigned char> &bytes, int denom, cv::Mat &dst);
+
+#endif
@@ -1,9 +1,12 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
@@ -13,6 +16,9 @@
 
 #include <boost/foreach.hpp>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
 #include "structs.h"
 #include "functions.hpp"
@@ -24,82 +30,163 @@ using namespace boost::filesystem;
 using boost::property_tree::ptree;
 
 //globals for run_analysis function
-string output_stem;
-ptree root;
 bool output, display, autolevels;
 
+//per image state for run_analysis, shared by the analyses running on it
+struct image_job {
+	string output_stem;
+	ptree root;
+	vector<pair<string, Mat>> windows; //results to imshow from the main thread
+	mutex lock; //guards root and windows
+};
+
 //run_analysis constants
-enum analysis_type {A_ELA, A_LG, A_AVGDIST, A_HSV, A_LAB, A_LAB_FAST, A_COPY_MOVE_DCT};
+enum analysis_type {A_ELA, A_LG, A_AVGDIST, A_HSV, A_LAB, A_LAB_FAST, A_YCBCR, A_HLS, A_COPY_MOVE_DCT, A_COPY_MOVE_PCA, A_COPY_MOVE_ORB};
 string analysis_name[] = {
 	"Error Level Analysis", "Luminance Gradient", "Average Distance",
-	"HSV Histogram", "Lab Histogram", "Lab Histogram (fast)", "Copy Move Detection (DCT)"
+	"HSV Histogram", "Lab Histogram", "Lab Histogram (fast)", "YCbCr Histogram",
+	"HLS Histogram", "Copy Move Detection (DCT)",
+	"Copy Move Detection (PCA)", "Copy Move Detection (ORB)"
+};
+string analysis_abbr[] = {"ela", "lg", "avgdist", "hsv", "lab", "lab_fast", "ycbcr", "hls", "copymove", "copymove_pca", "copymove_orb"};
+
+//an analysis asked for on the command line, run on every image
+struct analysis_request {
+	analysis_type type;
+	vector<double> params;
+	int scale; //run on the image decoded at 1/scale, 0 or 1 is full resolution
 };
-string analysis_abbr[] = {"ela", "lg", "avgdist", "hsv", "lab", "lab_fast", "copymove"};
+
+//autolevel, save and queue for display one result image, then merge its json
+//subtree into the job. output_filepath is without the extension
+void store_result(Mat &dst, string output_filepath, const string &title, const string &ptree_element, bool apply_autolevels, ptree &root, image_job &job) {
+	if(apply_autolevels) {
+		hsv_histogram_stretch(dst, dst);
+		output_filepath += "_autolevels";
+	}
+	output_filepath += ".png";
+
+	if(output) { //output image & add to ptree
+		bool write_success = imwrite(output_filepath, dst);
+		if(!write_success) {
+			root.put("filename", "Error! Do you have write permission?");
+		} else {
+			string filepath = canonical(output_filepath).make_preferred().string();
+			root.put("filename", filepath);
+		}
+	}
+
+	lock_guard<mutex> lock(job.lock);
+	if(!root.empty()) {
+		job.root.put_child(ptree_element, root);
+	}
+
+	if(display) { //displayed by the main thread, waitKey(0) at the end of program
+		job.windows.push_back(make_pair(title, dst));
+	} else { //release memory
+		dst.release();
+	}
+}
 
 //run analysis on src image
-void run_analysis(Mat &src, Mat &dst, analysis_type type, vector<double> params) {
-	string output_filepath = output_stem + "_" + analysis_abbr[type]; //file name
+void run_analysis(image_cache &cache, Mat &dst, analysis_type type, vector<double> params, image_job &job) {
+	string output_filepath = job.output_stem + "_" + analysis_abbr[type]; //file name
+	ptree root; //this analysis' json subtree, merged into job.root at the end
 	string title = analysis_name[type]; //display window title
 	string ptree_element = analysis_abbr[type]; //json tree title
 
 	bool apply_autolevels = autolevels && (type == A_ELA || type == A_LG || type == A_AVGDIST);
 	if(apply_autolevels) {
-		output_filepath += "_autolevels.png";
 		ptree_element += "_autolevels";
-	} else {
-		output_filepath += ".png";
 	}
 
+	Mat source = cache.source();
+
 	switch(type) {
 		case A_ELA:
-			error_level_analysis(src, dst, params[0]);
-			root.put(ptree_element + ".quality", params[0]);
-			break;
+			{
+				//one result per quality, a single quality keeps the plain names
+				ela_engine engine = (ela_engine)params[0];
+				vector<int> qualities(params.begin() + 1, params.end());
+				vector<Mat> results;
+				vector<ela_stats> stats;
+				error_level_analysis(source, results, qualities, stats, engine);
+
+				for(int i=0; i<qualities.size(); i++) {
+					ptree node;
+					node.put("quality", stats[i].quality);
+					node.put("engine", engine == ELA_DCT ? "dct" : "jpeg");
+					node.put("mean", stats[i].mean);
+					node.put("max", stats[i].max);
+					node.put("stddev", stats[i].stddev);
+					if(qualities.size() == 1) {
+						store_result(results[i], output_filepath, title, ptree_element, apply_autolevels, node, job);
+					} else {
+						string q = to_string(qualities[i]);
+						store_result(results[i], output_filepath + "_" + q, title + " (" + q + ")", ptree_element + "." + q, apply_autolevels, node, job);
+					}
+				}
+			}
+			return;
 		case A_LG:
-			luminance_gradient(src, dst);
+			luminance_gradient(cache, dst);
 			break;
 		case A_AVGDIST:
-			average_distance(src, dst);
+			average_distance(cache, dst);
 			break;
 		case A_HSV:
-			hsv_histogram(src, dst, params[0]);
-			root.put(ptree_element + ".whitebg", (bool)params[0]);
+			hsv_histogram(cache, dst, params[0]);
+			root.put("whitebg", (bool)params[0]);
 			break;
 		case A_LAB:
-			lab_histogram(src, dst, params[0]);
-			root.put(ptree_element + ".whitebg", (bool)params[0]);
+			lab_histogram(cache, dst, params[0]);
+			root.put("whitebg", (bool)params[0]);
 			break;
 		case A_LAB_FAST:
-			lab_histogram_fast(src, dst, params[0]);
-			root.put(ptree_element + ".whitebg", (bool)params[0]);
+			lab_histogram_fast(cache, dst, params[0]);
+			root.put("whitebg", (bool)params[0]);
+			break;
+		case A_YCBCR:
+			ycbcr_histogram(cache, dst, params[0]);
+			root.put("whitebg", (bool)params[0]);
+			break;
+		case A_HLS:
+			hls_histogram(cache, dst, params[0]);
+			root.put("whitebg", (bool)params[0]);
 			break;
 		case A_COPY_MOVE_DCT:
-			copy_move_dct(src, dst, params[0], params[1]);
-			root.put(ptree_element + ".retain", params[0]);
-			root.put(ptree_element + ".qcoeff", params[1]);
+		case A_COPY_MOVE_PCA:
+		case A_COPY_MOVE_ORB:
+			{
+				copy_move_params cm;
+				cm.retain = params[0];
+				cm.qcoeff = params[1];
+				cm.pyramid = params[2];
+				cm.blocksize = params[3];
+				cm.stride = params[4];
+				cm.memlimit = (size_t)(params[5] * 1024 * 1024);
+
+				if(type == A_COPY_MOVE_PCA) {
+					copy_move_pca(cache, dst, cm);
+				} else if(type == A_COPY_MOVE_ORB) {
+					copy_move_orb(cache, dst, cm);
+				} else {
+					copy_move_dct(cache, dst, cm);
+				}
+			}
+			//orb only uses the block size, it does not compare blocks
+			root.put("blocksize", params[3]);
+			if(type != A_COPY_MOVE_ORB) {
+				root.put("retain", params[0]);
+				root.put("qcoeff", params[1]);
+				root.put("pyramid", params[2]);
+				root.put("stride", params[4]);
+				root.put("memlimit", params[5]);
+			}
 			break;
 	}
 
-	if(apply_autolevels) {
-		hsv_histogram_stretch(dst, dst);
-	}
-
-	if(output) { //output image & add to ptree
-		bool write_success = imwrite(output_filepath, dst);
-		if(!write_success) {
-			root.put(ptree_element + ".filename", "Error! Do you have write permission?");
-		} else {
-			string filepath = canonical(output_filepath).make_preferred().string();
-			root.put(ptree_element + ".filename", filepath);
-		}
-	}
-	
-	if(display) { //display right away, waitKey(0) at the end of program
-		namedWindow(title);
-		imshow(title, dst);
-	} else { //release memory
-		dst.release();
-	}
+	store_result(dst, output_filepath, title, ptree_element, apply_autolevels, root, job);
 }
 
 //override ostream << operator for vector<double> so we can use it as implicit_value
@@ -117,23 +204,277 @@ namespace std {
 	}
 }
 
+//analyze one image: load it, run the requested analyses and estimate the
+//jpeg quality. with concurrent set the analyses run side by side, sharing the
+//thread pool.
+//without analyses only the jpeg headers are read, the pixels are never decoded.
+//preview analyses get a reduced size decode, the full size one is only made if
+//another analysis needs it. results are saved as output_stem + "_" + analysis.
+//returns false and sets error if the image cannot be used
+bool process_image(const path &source_path, const string &output_stem, const vector<analysis_request> &requests, bool quality, bool concurrent, image_job &job, string &error) {
+	Mat source_image, preview_image;
+	vector<unsigned char> bytes; //the file, decoded and indexed in memory
+	bool decode = !requests.empty(); //header-only (triage) runs skip the decode
+
+	bool full = false;
+	int preview = 1;
+	for(int i=0; i<requests.size(); i++) {
+		if(requests[i].scale > 1) {
+			preview = requests[i].scale;
+		} else {
+			full = true;
+		}
+	}
+
+	try { //check and try to open source image file
+		if(!exists(source_path)) {
+			error = "Error: File not found!";
+			return false;
+		}
+
+		if(!decode) { //just the headers
+			if(!read_jpeg_headers(source_path.string(), bytes)) {
+				error = "Error: Cannot read image!";
+				return false;
+			}
+		} else {
+			//load image to memory, the file is read only once
+			if(read_file(source_path.string(), bytes) && !bytes.empty()) {
+				if(full) {
+					source_image = decode_image(bytes);
+				}
+				if(preview > 1 && !decode_jpeg_scaled(bytes, preview, preview_image)) {
+					//not a jpeg, scale the full size decode instead
+					Mat image = full ? source_image : decode_image(bytes);
+					if(image.data != NULL) {
+						resize(image, preview_image, Size((image.cols + preview - 1) / preview, (image.rows + preview - 1) / preview), 0, 0, INTER_AREA);
+					}
+				}
+			}
+			if((full && source_image.data == NULL) || (preview > 1 && preview_image.data == NULL)) {
+				error = "Error: Cannot read image!";
+				return false;
+			}
+		}
+	} catch(const exception &e) { //cannot load the image for some reason
+		error = string("Error: Problem while opening the file!\n") + e.what();
+		return false;
+	}
+
+	job.output_stem = output_stem;
+
+	//conversions shared by the analyses
+	image_cache full_cache(source_image), preview_cache(preview_image);
+	if(preview > 1) {
+		job.root.put("preview", preview);
+	}
+
+	if(concurrent && requests.size() > 1) { //wall-clock of the slowest analysis
+		//the analyses run side by side as members of the thread pool, their
+		//parallel parts share its free threads. copy-move goes first, it runs
+		//longest and gets the threads the others leave when they finish
+		vector<int> order;
+		for(int i=0; i<requests.size(); i++) {
+			analysis_type type = requests[i].type;
+			if(type == A_COPY_MOVE_DCT || type == A_COPY_MOVE_PCA || type == A_COPY_MOVE_ORB) {
+				order.insert(order.begin(), i);
+			} else {
+				order.push_back(i);
+			}
+		}
+
+		int running = min(get_num_threads(), (int)requests.size());
+		atomic<int> next_request(0);
+		vector<thread> tasks;
+		release_worker(); //this thread only waits for the tasks
+		for(int w=0; w<running; w++) {
+			tasks.push_back(thread([&]() {
+				acquire_worker();
+				int i;
+				while((i = next_request++) < (int)order.size()) {
+					Mat result;
+					const analysis_request &request = requests[order[i]];
+					run_analysis(request.scale > 1 ? preview_cache : full_cache, result, request.type, request.params, job);
+				}
+				release_worker();
+			}));
+		}
+		for(int i=0; i<tasks.size(); i++) {
+			tasks[i].join();
+		}
+		acquire_worker();
+	} else {
+		for(int i=0; i<requests.size(); i++) {
+			Mat result;
+			run_analysis(requests[i].scale > 1 ? preview_cache : full_cache, result, requests[i].type, requests[i].params, job);
+		}
+	}
+
+	if(quality) {
+		int num_qtables = 0;
+		vector<qtable> qtables;
+		vector<double> quality;
+
+		jpeg_index index(bytes.empty() ? NULL : &bytes[0], bytes.size(), true);
+		num_qtables = estimate_jpeg_quality(index, qtables, quality);
+
+		jpeg_frame frame;
+		if(index.frame(frame)) { //basic SOF info
+			job.root.put("frame.width", frame.width);
+			job.root.put("frame.height", frame.height);
+			job.root.put("frame.components", frame.components);
+			job.root.put("frame.precision", frame.precision);
+			job.root.put("frame.subsampling", frame.subsampling);
+			job.root.put("frame.progressive", frame.progressive);
+		}
+
+		if(num_qtables > 0) { //if we have quantization tables, save them to ptree
+			job.root.put("imagick_estimate", quality[0]);
+			job.root.put("hf_estimate", quality[1]);
+			for(int i=0; i<num_qtables; i++) { //loop through the table and append as comma separated vals
+				stringstream dqt;
+				for(int j=0; j<8; j++) {
+					for(int k=0; k<8; k++) {
+						dqt << qtables[i].table.at<float>(j, k);
+						if(j*k < 48) {
+							dqt << ",";
+						}
+					}
+				}
+				stringstream tableindex;
+				tableindex << "qtables." << i;
+				job.root.put(tableindex.str(), dqt.str());
+			}
+		}
+	}
+
+	return true;
+}
+
+//match a file name against a pattern with * and ? wildcards
+bool wildcard_match(const string &pattern, const string &name) {
+	size_t p = 0, n = 0, star = string::npos, mark = 0;
+	while(n < name.size()) {
+		if(p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+			p++;
+			n++;
+		} else if(p < pattern.size() && pattern[p] == '*') {
+			star = p++;
+			mark = n;
+		} else if(star != string::npos) {
+			p = star + 1;
+			n = ++mark;
+		} else {
+			return false;
+		}
+	}
+	while(p < pattern.size() && pattern[p] == '*') {
+		p++;
+	}
+	return p == pattern.size();
+}
+
+//collect the images of a batch: a directory, a glob (wildcards in the file name),
+//a text file with one path per line, or - for paths on stdin
+bool collect_batch(const string &source, vector<path> &files) {
+	string extensions[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff"};
+
+	if(source == "-") {
+		string line;
+		while(getline(cin, line)) {
+			boost::trim(line);
+			if(!line.empty()) files.push_back(line);
+		}
+		return true;
+	}
+
+	path source_path(source);
+	if(source.find_first_of("*?") != string::npos) {
+		path directory = source_path.parent_path();
+		if(directory.empty()) directory = ".";
+		if(!is_directory(directory)) return false;
+
+		string pattern = source_path.filename().string();
+		for(directory_iterator it(directory); it != directory_iterator(); it++) {
+			if(is_regular_file(it->status()) && wildcard_match(pattern, it->path().filename().string())) {
+				files.push_back(it->path());
+			}
+		}
+	} else if(is_directory(source_path)) {
+		for(directory_iterator it(source_path); it != directory_iterator(); it++) {
+			string extension = boost::to_lower_copy(it->path().extension().string());
+			if(is_regular_file(it->status()) && find(extensions, extensions + 6, extension) != extensions + 6) {
+				files.push_back(it->path());
+			}
+		}
+	} else if(is_regular_file(source_path)) {
+		boost::filesystem::ifstream list(source_path);
+		string line;
+		while(getline(list, line)) {
+			boost::trim(line);
+			if(!line.empty()) files.push_back(line);
+		}
+	} else {
+		return false;
+	}
+
+	sort(files.begin(), files.end());
+	return true;
+}
+
+//output file names of the batch images, one per image. the file stem, unless
+//another image shares it (IMG_1.jpg and IMG_1.png), then the file name with its
+//extension, and if that is shared too (same name in different directories of a
+//list) the batch index is appended
+vector<string> batch_stems(const vector<path> &files) {
+	map<string, int> stems, names;
+	for(int i=0; i<files.size(); i++) {
+		stems[files[i].stem().string()]++;
+		names[files[i].filename().string()]++;
+	}
+
+	vector<string> result;
+	set<string> used;
+	for(int i=0; i<files.size(); i++) {
+		string stem = files[i].stem().string(), name = files[i].filename().string();
+		string unique = stems[stem] == 1 ? stem : (names[name] == 1 ? name : name + "_" + to_string(i));
+		while(!used.insert(unique).second) {
+			unique += "_" + to_string(i);
+		}
+		result.push_back(unique);
+	}
+	return result;
+}
+
 int main(int argc, char *argv[]) {
 	//declare program options
-	options_description desc("USAGE: phoenix -f <path_to_file> [options]\nAllowed options");
+	options_description desc("USAGE: phoenix -f <path_to_file> [options]\n       phoenix -batch <directory|glob|list_file|-> [options]\nAllowed options");
 	desc.add_options()
 		("help,h", "List all arguments - produce help message")
-		("file,f", value<string>()->required(), "Source image file")
+		("file,f", value<string>(), "Source image file")
+		("batch,b", value<string>(), "Analyze many images: a directory, a glob, a file with one path per line or - for stdin. Prints one JSON line per image")
 
-		("ela", value<int>()->implicit_value(70), "Error Level Analysis [quality]")
+		("ela", value<vector<double>>()->multitoken()->implicit_value(vector<double>{70}), "Error Level Analysis [quality ...]")
+		("elaengine", value<string>()->default_value("jpeg"), "Error Level Analysis engine: jpeg or dct")
+		("preview", value<int>(), "Run lg, avgdist and the histograms on a 1/scale decode: 2, 4 or 8 [scale]")
 		("hsv", value<int>()->implicit_value(0), "HSV Colorspace Histogram [whitebg]")
 		("lab", value<int>()->implicit_value(0), "Lab Colorspace Histogram [whitebg]")
 		("labfast", value<int>()->implicit_value(0), "Lab Colorspace Histogram (Fast Version) [whitebg]")
+		("ycbcr", value<int>()->implicit_value(0), "YCbCr Colorspace Histogram [whitebg]")
+		("hls", value<int>()->implicit_value(0), "HLS Colorspace Histogram [whitebg]")
 		("lg", bool_switch()->default_value(false), "Luminance Gradient")
 		("avgdist", bool_switch()->default_value(false), "Average Distance")
 		("copymove", value<vector<double>>()->multitoken()->implicit_value(vector<double>{4, 1.0}), "Copy-Move Detection (DCT) [retain] [qcoeff]")
+		("cmpyramid", value<int>()->implicit_value(1), "Copy-Move coarse-to-fine pre-screen [levels]")
+		("cmblock", value<int>()->default_value(16), "Copy-Move block size")
+		("cmstride", value<int>()->default_value(1), "Copy-Move pixels between blocks")
+		("cmengine", value<string>()->default_value("dct"), "Copy-Move engine: dct, pca or orb")
+		("memlimit", value<double>()->default_value(0), "Copy-Move memory budget in MB, sorts on disk above it (0 = no limit)")
+		("cmfast", bool_switch()->default_value(false), "Copy-Move fast-scan preset (stride 2, 1 pyramid level)")
 
 		("autolevels,a", bool_switch()->default_value(false), "Apply histogram stretch to outputs")
 		("quality,q", bool_switch()->default_value(true), "Estimate JPEG Quality")
+		("threads,t", value<int>()->default_value(0), "Worker threads (0 = one per CPU core)")
 
 		("output,o", value<string>()->implicit_value("./"), "Output folder path")
 		("display,d", bool_switch()->default_value(false), "Display outputs")
@@ -173,27 +514,17 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
+	bool batch = vm.count("batch");
+	if(!batch && !vm.count("file")) {
+		cout << "Error: No source image, use -f <path_to_file> or -batch <source>." << endl;
+		cout << "Use -h or -help flag to see available commands." << endl;
+		return 1;
+	}
+
 	//some path info
-	path source_path;
 	path output_path;
-	Mat source_image;
-
-	try { //check and try to open source image file (-f)
-		source_path = vm["file"].as<string>();
-		if(!exists(source_path)) {
-			cout << "Error: File not found!" << endl;
-			cout << "File path input: " << source_path << endl;
-			return 1;
-		}
-
-		//load image to memory
-		source_image = imread(source_path.string(), CV_LOAD_IMAGE_COLOR);
-		if(source_image.data == NULL) {
-			cout << "Error: Cannot read image!" << endl;
-			cout << "File path input: " << source_path << endl;
-			return 1;
-		}
 
+	try {
 		//validate output path
 		if(vm.count("output")) {
 			output_path = vm["output"].as<string>();
@@ -204,101 +535,196 @@ int main(int argc, char *argv[]) {
 			}
 			output_path = canonical(output_path.make_preferred());
 		}
-	} catch(const exception &e) { //cannot load the image for some reason
-		cout << "Error: Problem while opening the file!" << endl;
+	} catch(const exception &e) {
+		cout << "Error: Problem with the output directory!" << endl;
 		cout << e.what() << endl;
 		return 1;
 	}
 
 	//assign globals
-	display = vm["display"].as<bool>();
+	display = vm["display"].as<bool>() && !batch; //no windows from batch workers
 	output = vm.count("output");
 	autolevels = vm["autolevels"].as<bool>();
-	output_stem = output_path.string() + "/" + source_path.stem().string();
-	
+	set_num_threads(vm["threads"].as<int>());
+
 	bool verbose = vm["verbose"].as<bool>();
 
+	//analyses to run on every image
+	vector<analysis_request> requests;
+
 	if(vm.count("ela")) {
-		Mat ela;
-		vector<double> params {(double) vm["ela"].as<int>()};
+		string engine_name = vm["elaengine"].as<string>();
+		if(engine_name != "jpeg" && engine_name != "dct") {
+			cout << "Error: Unknown ELA engine! Use jpeg or dct." << endl;
+			return 1;
+		}
+
+		//engine, then the qualities
+		vector<double> params {(double)(engine_name == "dct" ? ELA_DCT : ELA_JPEG)};
+		vector<double> qualities = vm["ela"].as<vector<double>>();
+		params.insert(params.end(), qualities.begin(), qualities.end());
 
-		run_analysis(source_image, ela, A_ELA, params);
+		requests.push_back(analysis_request {A_ELA, params});
 	}
 
 	if(vm["lg"].as<bool>()) {
-		Mat lg;
 		vector<double> params;
 
-		run_analysis(source_image, lg, A_LG, params);
+		requests.push_back(analysis_request {A_LG, params});
 	}
 
 	if(vm["avgdist"].as<bool>()) {
-		Mat avgdist;
 		vector<double> params;
 
-		run_analysis(source_image, avgdist, A_AVGDIST, params);
+		requests.push_back(analysis_request {A_AVGDIST, params});
 	}
 
 	if(vm.count("hsv")) {
-		Mat hsv;
 		vector<double> params {(double) vm["hsv"].as<int>()};
 
-		run_analysis(source_image, hsv, A_HSV, params);
+		requests.push_back(analysis_request {A_HSV, params});
 	}
 
 	if(vm.count("lab")) {
-		Mat lab;
 		vector<double> params {(double) vm["lab"].as<int>()};
 
-		run_analysis(source_image, lab, A_LAB, params);
+		requests.push_back(analysis_request {A_LAB, params});
 	}
 
 	if(vm.count("labfast")) {
-		Mat lab;
 		vector<double> params {(double) vm["labfast"].as<int>()};
 
-		run_analysis(source_image, lab, A_LAB_FAST, params);
+		requests.push_back(analysis_request {A_LAB_FAST, params});
+	}
+
+	if(vm.count("ycbcr")) {
+		vector<double> params {(double) vm["ycbcr"].as<int>()};
+
+		requests.push_back(analysis_request {A_YCBCR, params});
+	}
+
+	if(vm.count("hls")) {
+		vector<double> params {(double) vm["hls"].as<int>()};
+
+		requests.push_back(analysis_request {A_HLS, params});
 	}
 
 	if(vm.count("copymove")) {
-		Mat copymove;
 		vector<double> input = vm["copymove"].as<vector<double>>();
 		vector<double> params;
 		if(input.size() == 1) {
-			if(input[0] > 16) input[0] = 16;
 			params = {input[0], 1.0};
 		} else {
-			params = input;
+			params = {input[0], input[1]};
+		}
+
+		//coarse-to-fine pyramid levels, block size and stride
+		int pyramid = vm.count("cmpyramid") ? vm["cmpyramid"].as<int>() : 0;
+		int blocksize = vm["cmblock"].as<int>();
+		int stride = vm["cmstride"].as<int>();
+		if(vm["cmfast"].as<bool>()) { //triage preset, explicit options still win
+			if(vm["cmstride"].defaulted()) stride = 2;
+			if(!vm.count("cmpyramid")) pyramid = 1;
+		}
+		if(params[0] > blocksize) params[0] = blocksize;
+		params.push_back(pyramid);
+		params.push_back(blocksize);
+		params.push_back(stride);
+		params.push_back(vm["memlimit"].as<double>());
+
+		analysis_type engine = A_COPY_MOVE_DCT;
+		string engine_name = vm["cmengine"].as<string>();
+		if(engine_name == "pca") {
+			engine = A_COPY_MOVE_PCA;
+		} else if(engine_name == "orb") {
+			engine = A_COPY_MOVE_ORB;
+		} else if(engine_name != "dct") {
+			cout << "Error: Unknown copy-move engine! Use dct, pca or orb." << endl;
+			return 1;
 		}
 
-		run_analysis(source_image, copymove, A_COPY_MOVE_DCT, params);
+		requests.push_back(analysis_request {engine, params});
 	}
 
-	if(vm["quality"].as<bool>()) {
-		int num_qtables = 0;
-		vector<qtable> qtables;
-		vector<double> quality;
+	if(vm.count("preview")) { //reduced size decode for the visual analyses
+		int scale = vm["preview"].as<int>();
+		if(scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+			cout << "Error: Preview scale must be 1, 2, 4 or 8." << endl;
+			return 1;
+		}
+		for(int i=0; i<requests.size(); i++) {
+			analysis_type type = requests[i].type;
+			if(type == A_LG || type == A_AVGDIST || type == A_HSV || type == A_LAB || type == A_LAB_FAST || type == A_YCBCR || type == A_HLS) {
+				requests[i].scale = scale;
+			}
+		}
+	}
 
-		num_qtables = estimate_jpeg_quality(source_path.string().c_str(), qtables, quality);
+	bool quality = vm["quality"].as<bool>();
 
-		if(num_qtables > 0) { //if we have quantization tables, save them to ptree
-			root.put("imagick_estimate", quality[0]);
-			root.put("hf_estimate", quality[1]);
-			for(int i=0; i<num_qtables; i++) { //loop through the table and append as comma separated vals
-				stringstream dqt;
-				for(int j=0; j<8; j++) {
-					for(int k=0; k<8; k++) {
-						dqt << qtables[i].table.at<float>(j, k);
-						if(j*k < 48) {
-							dqt << ",";
-						}
+	if(batch) {
+		vector<path> files;
+		if(!collect_batch(vm["batch"].as<string>(), files)) {
+			cout << "Error: Cannot read batch source!" << endl;
+			cout << "Batch input: " << vm["batch"].as<string>() << endl;
+			return 1;
+		}
+
+		vector<string> stems = batch_stems(files);
+
+		//one image per worker, the workers are members of the thread pool and
+		//split its threads between their images, the last ones get all of them
+		int workers = max(1, min(get_num_threads(), (int)files.size()));
+		release_worker(); //this thread only waits for the workers
+
+		atomic<size_t> next_file(0);
+		mutex print_mutex;
+		vector<thread> pool;
+		for(int w=0; w<workers; w++) {
+			pool.push_back(thread([&]() {
+				acquire_worker();
+				size_t i;
+				while((i = next_file++) < files.size()) {
+					image_job job;
+					string error;
+					string output_stem = output_path.string() + "/" + stems[i];
+					if(!process_image(files[i], output_stem, requests, quality, false, job, error)) {
+						job.root.put("error", error);
+					}
+					job.root.put("file", files[i].string());
+					if(output) {
+						job.root.put("output", output_stem);
 					}
+
+					//one JSON record per line
+					stringstream record;
+					write_json(record, job.root, false);
+					lock_guard<mutex> lock(print_mutex);
+					cout << record.str() << flush;
 				}
-				stringstream tableindex;
-				tableindex << "qtables." << i;
-				root.put(tableindex.str(), dqt.str());
-			}
+				release_worker();
+			}));
+		}
+		for(int w=0; w<workers; w++) {
+			pool[w].join();
 		}
+		acquire_worker();
+
+		return 0;
+	}
+
+	path source_path = vm["file"].as<string>();
+	image_job job;
+	string error;
+	if(!process_image(source_path, output_path.string() + "/" + source_path.stem().string(), requests, quality, true, job, error)) {
+		cout << error << endl;
+		cout << "File path input: " << source_path << endl;
+		return 1;
+	}
+
+	for(int i=0; i<job.windows.size(); i++) { //highgui wants the main thread
+		namedWindow(job.windows[i].first);
+		imshow(job.windows[i].first, job.windows[i].second);
 	}
 
 	if(vm.count("output") == 0 && vm["display"].defaulted()) {
@@ -306,7 +732,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	if(vm["json"].as<bool>() || !vm["quality"].defaulted()) {
-		write_json(cout, root);
+		write_json(cout, job.root);
 	}
 
 	if(display) {
@@ -2,6 +2,8 @@
 #define STRUCTS_H
 
 #include <string>
+#include <vector>
+#include <mutex>
 
 #include <opencv2/core/core.hpp>
 
@@ -14,4 +16,53 @@ struct qtable {
 	double im_qval;
 };
 
+struct copy_move_params {
+	int retain; //side of the DCT submatrix compared
+	double qcoeff; //quantization step for the DCT coefficients
+	int blocksize; //side of the compared blocks
+	int stride; //pixels between compared blocks
+	int pyramid; //levels of the coarse-to-fine pre-screen, 0 = off
+	size_t memlimit; //bytes for the block keys and their extraction, sorts on disk above it, 0 = no limit
+
+	copy_move_params() : retain(4), qcoeff(1.0), blocksize(16), stride(1), pyramid(0), memlimit(0) {}
+};
+
+//how error_level_analysis produces the resaved image
+enum ela_engine {
+	ELA_JPEG, //imencode & imdecode
+	ELA_DCT //8x8 block DCT, quantization & inverse DCT, no entropy coding
+};
+
+struct ela_stats {
+	int quality; //jpeg quality of the resave
+	double mean; //of the absolute differences, over all channels
+	double max;
+	double stddev;
+};
+
+//unique colors of an image, see unique_colors
+struct color_table {
+	cv::Mat colors; //N x 1 CV_8UC3, BGR, ascending by B, then G, then R
+	std::vector<int> counts; //pixels of each color
+};
+
+/*
+	Intermediate images derived from one source image. Each one is computed the
+	first time an analysis asks for it and then shared by every analysis running
+	on that image, from any thread
+*/
+class image_cache {
+public:
+	explicit image_cache(const cv::Mat &source) : src(source) {}
+
+	const cv::Mat &source() const { return src; }
+	const cv::Mat &grayscale(); //CV_8U
+	const color_table &colors(); //unique BGR colors and their pixel counts
+
+private:
+	cv::Mat src, gray;
+	color_table table;
+	std::once_flag gray_once, table_once;
+};
+
 #endif
\ No newline at end of file